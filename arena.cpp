@@ -0,0 +1,209 @@
+#include <algorithm>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "arena.h"
+
+namespace Document {
+
+const size_t Arena_storage::BLOCK_SIZE = 1 << 20;
+const size_t Arena_storage::MIN_LINE_CAPACITY = 8;
+
+Arena_storage::Arena_storage()
+    : live_bytes(0)
+    , garbage_bytes(0)
+{
+    entries.push_back(allocate(0));
+}
+
+char* Arena_storage::text(const Line_entry& entry) const
+{
+    return blocks[entry.block].data.get() + entry.offset;
+}
+
+std::string_view Arena_storage::view(const Line_entry& entry) const
+{
+    return std::string_view(text(entry), entry.length);
+}
+
+Arena_storage::Line_entry Arena_storage::allocate(size_t capacity)
+{
+    capacity = std::max(capacity, MIN_LINE_CAPACITY);
+
+    // volne miesto zdielaneho bloku moze obsadit aj kopia
+    if (blocks.empty() or blocks.back().size - blocks.back().used < capacity
+        or shared(uint32_t(blocks.size() - 1))) {
+        // dlhe riadky dostanu vlastny blok
+        size_t size = std::max(BLOCK_SIZE, capacity);
+        blocks.push_back(Block {
+            std::shared_ptr<char[]>(new char[size]), uint32_t(size), 0 });
+    }
+
+    Block& block = blocks.back();
+    Line_entry entry { uint32_t(blocks.size() - 1), block.used, 0,
+        uint32_t(capacity) };
+    block.used += capacity;
+    live_bytes += capacity;
+    return entry;
+}
+
+void Arena_storage::release(const Line_entry& entry)
+{
+    live_bytes -= entry.capacity;
+    garbage_bytes += entry.capacity;
+}
+
+bool Arena_storage::shared(uint32_t block) const
+{
+    return blocks[block].data.use_count() > 1;
+}
+
+void Arena_storage::reserve(Line_entry& entry, size_t extra)
+{
+    if (entry.length + extra <= entry.capacity and !shared(entry.block))
+        return;
+
+    // zo zdielaneho bloku sa presuva aj riadok, ktory sa do miesta zmesti
+    size_t capacity = entry.length + extra <= entry.capacity
+        ? entry.capacity
+        : std::max<size_t>(entry.capacity * 2, entry.length + extra);
+    Line_entry moved = allocate(capacity);
+    std::memcpy(text(moved), text(entry), entry.length);
+    moved.length = entry.length;
+    release(entry);
+    entry = moved;
+}
+
+void Arena_storage::compact_if_needed()
+{
+    if (garbage_bytes < BLOCK_SIZE or garbage_bytes < live_bytes)
+        return;
+
+    // riadky poukladame tesne za seba do novych blokov, v poradi dokumentu
+    std::vector<Block> old_blocks = std::move(blocks);
+    blocks.clear();
+    live_bytes = 0;
+    garbage_bytes = 0;
+
+    for (auto&& entry : entries) {
+        Line_entry compacted = allocate(entry.length + entry.length / 4);
+        std::memcpy(text(compacted),
+            old_blocks[entry.block].data.get() + entry.offset, entry.length);
+        compacted.length = entry.length;
+        entry = compacted;
+    }
+}
+
+std::unique_ptr<Storage> Arena_storage::copy() const
+{
+    // O(lines) zaznamov po 16 bajtov, text sa nekopiruje
+    return std::make_unique<Arena_storage>(*this);
+}
+
+size_t Arena_storage::lines_count() const { return entries.size(); }
+
+size_t Arena_storage::line_length(size_t line) const
+{
+    return entries[line].length;
+}
+
+std::string Arena_storage::line(size_t line) const
+{
+    return std::string(view(entries[line]));
+}
+
+void Arena_storage::for_each_line(
+    const std::function<void(const Line_view&)>& f) const
+{
+    for (auto&& entry : entries)
+        f(Line_view(view(entry)));
+}
+
+size_t Arena_storage::memory_usage() const
+{
+    size_t usage = sizeof(*this) + entries.capacity() * sizeof(Line_entry)
+        + blocks.capacity() * sizeof(Block);
+    for (auto&& block : blocks)
+        usage += block.size;
+    return usage;
+}
+
+void Arena_storage::insert_line(size_t line, const std::string& content)
+{
+    Line_entry entry = allocate(content.size());
+    std::memcpy(text(entry), content.data(), content.size());
+    entry.length = content.size();
+    entries.insert(entries.begin() + line, entry);
+}
+
+void Arena_storage::delete_line(size_t line)
+{
+    release(entries[line]);
+    entries.erase(entries.begin() + line);
+    compact_if_needed();
+}
+
+void Arena_storage::replace_lines(
+    size_t line, size_t count, const std::vector<std::string>& content)
+{
+    for (size_t i = line; i < line + count; ++i)
+        release(entries[i]);
+    std::vector<Line_entry> added;
+    added.reserve(content.size());
+    for (auto&& text : content) {
+        Line_entry entry = allocate(text.size());
+        std::memcpy(this->text(entry), text.data(), text.size());
+        entry.length = text.size();
+        added.push_back(entry);
+    }
+    entries.erase(entries.begin() + line, entries.begin() + line + count);
+    entries.insert(entries.begin() + line, added.begin(), added.end());
+    compact_if_needed();
+}
+
+void Arena_storage::break_line(size_t line, size_t column)
+{
+    Line_entry& entry = entries[line];
+    size_t rest_length = entry.length - column;
+    Line_entry rest = allocate(rest_length);
+    std::memcpy(text(rest), text(entry) + column, rest_length);
+    rest.length = rest_length;
+    entry.length = column;
+
+    entries.insert(entries.begin() + line + 1, rest);
+}
+
+void Arena_storage::join_lines(size_t line)
+{
+    Line_entry next = entries[line + 1];
+    Line_entry& entry = entries[line];
+    reserve(entry, next.length);
+    std::memcpy(text(entry) + entry.length, text(next), next.length);
+    entry.length += next.length;
+
+    delete_line(line + 1);
+}
+
+void Arena_storage::insert_char(size_t line, size_t column, char ch)
+{
+    Line_entry& entry = entries[line];
+    reserve(entry, 1);
+    char* t = text(entry);
+    std::memmove(t + column + 1, t + column, entry.length - column);
+    t[column] = ch;
+    ++entry.length;
+    compact_if_needed();
+}
+
+void Arena_storage::delete_char(size_t line, size_t column)
+{
+    Line_entry& entry = entries[line];
+    reserve(entry, 0);
+    char* t = text(entry);
+    std::memmove(t + column, t + column + 1, entry.length - column - 1);
+    --entry.length;
+}
+
+}
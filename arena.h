@@ -0,0 +1,73 @@
+#ifndef M_ARENA
+#define M_ARENA
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "storage.h"
+
+namespace Document {
+
+// Vsetok text je vo velkych blokoch, riadok je iba 16 bajtovy zaznam
+//  (blok, offset, dlzka, kapacita). Ked sa riadok do svojho miesta nezmesti,
+//  presunie sa na koniec areny a stare miesto ostane ako odpad. Ked je
+//  odpadu viac ako zivych dat, arena sa zkompaktuje.
+//
+// Kopia zdiela bloky a kopiruje iba zaznamy riadkov. Do zdielaneho bloku
+//  sa nezapisuje: upravovany riadok sa najprv presunie do vlastneho bloku
+//  (copy-on-write po riadkoch), nove riadky idu vzdy do vlastneho bloku.
+class Arena_storage : public Storage {
+public:
+    Arena_storage();
+
+    size_t lines_count() const override;
+    size_t line_length(size_t line) const override;
+    std::string line(size_t line) const override;
+    void for_each_line(
+        const std::function<void(const Line_view&)>& f) const override;
+    size_t memory_usage() const override;
+    std::unique_ptr<Storage> copy() const override;
+
+    void insert_line(size_t line, const std::string& content) override;
+    void delete_line(size_t line) override;
+    void break_line(size_t line, size_t column) override;
+    void join_lines(size_t line) override;
+    void insert_char(size_t line, size_t column, char ch) override;
+    void delete_char(size_t line, size_t column) override;
+    void replace_lines(size_t line, size_t count,
+        const std::vector<std::string>& content) override;
+
+private:
+    struct Line_entry {
+        uint32_t block, offset, length, capacity;
+    };
+
+    struct Block {
+        std::shared_ptr<char[]> data;
+        uint32_t size, used;
+    };
+
+    char* text(const Line_entry& entry) const;
+    std::string_view view(const Line_entry& entry) const;
+    // Vrati novy zaznam s miestom pre aspon capacity znakov
+    Line_entry allocate(size_t capacity);
+    void release(const Line_entry& entry);
+    // Zabezpeci, ze sa do riadku zmesti este extra znakov a ze je v bloku,
+    //  ktory nezdiela ziadna kopia
+    void reserve(Line_entry& entry, size_t extra);
+    bool shared(uint32_t block) const;
+    void compact_if_needed();
+
+    std::vector<Line_entry> entries;
+    std::vector<Block> blocks;
+    size_t live_bytes, garbage_bytes;
+
+    static const size_t BLOCK_SIZE;
+    static const size_t MIN_LINE_CAPACITY;
+};
+
+}
+
+#endif
@@ -4,28 +4,41 @@
 #include <boost/asio.hpp>
 #include <boost/bind/bind.hpp>
 #include <boost/thread/thread.hpp>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
 #include <functional>
 #include <iostream>
+#include <mutex>
 #include <ncurses.h>
 #include <string>
+#include <sys/ioctl.h>
+#include <thread>
+#include <unistd.h>
 
 using boost::asio::ip::tcp;
+namespace Protocol = Document::Protocol;
 
 struct Tcp_client {
 
 public:
-    explicit Tcp_client(const char* address)
+    Tcp_client(const char* address, std::string document_name)
         : socket(tcp::socket(io_context))
         , connected(false)
         , address(address)
-        , buff(std::vector<char>(MAX_BUFF_LENGTH))
+        , document_name(std::move(document_name))
         , id(-1)
+        , sending(false)
     {
     }
 
+    ~Tcp_client() { stop_sending(); }
+
     bool is_connected() const { return connected; }
+    size_t get_id() const { return id; }
 
-    bool connect()
+    // Server posiela iba okno okolo height riadkov, 0 je cely dokument
+    bool connect(size_t height)
     {
         try {
             tcp::resolver resolver(io_context);
@@ -33,18 +46,32 @@ public:
                 = resolver.resolve(address, PORT);
 
             boost::asio::connect(socket, endpoints);
-
-            // receive my id
-            std::vector<char> temp_buff(32);
-            size_t l = socket.read_some(boost::asio::buffer(temp_buff));
-
-            // set id
-            std::stringstream s1;
-            s1.write(temp_buff.data(), l);
-            std::stringstream s2(s1.str());
-            s2 >> id;
-
-            send_message("DD");
+            // frame-y sa zlucuju uz pri odosielani, Nagle by iba zdrzal
+            socket.set_option(tcp::no_delay(true));
+            start_sending();
+
+            // handshake, server odmietne inu verziu protokolu, dokument
+            //  vytvori, ak este neexistuje
+            std::string hello;
+            Protocol::put_varint(hello, Protocol::VERSION);
+            Protocol::put_bytes(hello, document_name);
+            Protocol::put_varint(hello, height);
+            write_frame(Protocol::Message_type::Hello, hello);
+
+            Protocol::Message_type type;
+            std::shared_ptr<const std::string> payload;
+            if (!read_frame(type, payload))
+                throw std::runtime_error("Connection closed by server");
+            if (type == Protocol::Message_type::Error)
+                throw std::runtime_error("Server refused: " + *payload);
+            if (type != Protocol::Message_type::Welcome)
+                throw std::runtime_error("Expected welcome from server");
+
+            // set id, cely obraz dokumentu pride hned za Welcome
+            Protocol::Reader reader(
+                payload->data(), payload->data() + payload->size());
+            reader.varint();
+            id = reader.varint();
 
             connected = true;
         } catch (std::exception& e) {
@@ -54,52 +81,161 @@ public:
         return true;
     }
 
-    void send_message(std::string message)
+    // Server prikaz potvrdi v delte podla sequence
+    void send_command(uint64_t sequence, const std::string& message)
     {
-        socket.write_some(boost::asio::buffer(message));
+        std::string payload;
+        Protocol::put_varint(payload, sequence);
+        payload += message;
+        write_frame(Protocol::Message_type::Command, payload);
     }
 
-    void receive_loop(const std::function<void(std::vector<char>, int)>&
-            handle_received_message)
-    {
-        boost::system::error_code error;
+    // vypyta si novy obraz, ked replike chyba delta
+    void send_resync() { write_frame(Protocol::Message_type::Resync); }
 
-        for (;;) {
-            // size_t len = socket.read_some(boost::asio::buffer(buff), error);
-            socket.read_some(boost::asio::buffer(buff), error);
+    // Obrazovka je teraz od riadku first, server posle okno okolo nej
+    void send_viewport(size_t first, size_t height)
+    {
+        std::string payload;
+        Protocol::put_varint(payload, first);
+        Protocol::put_varint(payload, height);
+        write_frame(Protocol::Message_type::Viewport, payload);
+    }
 
-            if (error == boost::asio::error::eof) {
-                connected = false;
-                break; // Connection closed cleanly by peer.
-            } else if (error)
+    // Precita jeden frame, false pri EOF. Bajty za nim ostanu v decoder
+    //  pre dalsie volanie.
+    bool read_frame(Protocol::Message_type& type,
+        std::shared_ptr<const std::string>& payload)
+    {
+        while (!decoder.next(type, payload)) {
+            size_t size;
+            char* data = decoder.prepare(size);
+            boost::system::error_code error;
+            size_t read
+                = socket.read_some(boost::asio::buffer(data, size), error);
+            if (error == boost::asio::error::eof)
+                return false; // Connection closed cleanly by peer.
+            else if (error)
                 throw boost::system::system_error(error); // Some other error.
-
-            // (*handle_received_message)(buff, id);
-            handle_received_message(buff, id);
+            decoder.commit(read);
         }
+        return true;
+    }
+
+    void receive_loop(const std::function<void(Protocol::Message_type,
+            std::shared_ptr<const std::string>, int)>& handle_received_message)
+    {
+        Protocol::Message_type type;
+        std::shared_ptr<const std::string> payload;
+        while (read_frame(type, payload))
+            handle_received_message(type, payload, id);
+        connected = false;
     }
 
 private:
+    // Frame sa iba zaradi, vlakno vstupu na siet necaka
+    void write_frame(
+        Protocol::Message_type type, std::string_view payload = {})
+    {
+        std::string frame = Protocol::frame(type, payload);
+        {
+            std::lock_guard<std::mutex> lock(send_mtx);
+            if (!sending)
+                return;
+            if (outgoing.empty())
+                first_queued = std::chrono::steady_clock::now();
+            outgoing += frame;
+        }
+        send_ready.notify_one();
+    }
+
+    void start_sending()
+    {
+        sending = true;
+        sender = std::thread(&Tcp_client::send_loop, this);
+    }
+
+    // Odosle, co este caka, a pocka na vlakno odosielania
+    void stop_sending()
+    {
+        {
+            std::lock_guard<std::mutex> lock(send_mtx);
+            sending = false;
+        }
+        send_ready.notify_one();
+        if (sender.joinable())
+            sender.join();
+    }
+
+    // Vlakno odosielania. Frame-y zaradene do SEND_DELAY od prveho idu
+    //  spolu jednym zapisom, pocas zapisu sa zbiera dalsia davka.
+    //  boost::asio::write opakuje kratke zapisy, kym neodide vsetko.
+    void send_loop()
+    {
+        std::string batch;
+        std::unique_lock<std::mutex> lock(send_mtx);
+        for (;;) {
+            send_ready.wait(
+                lock, [this] { return !outgoing.empty() or !sending; });
+            if (outgoing.empty())
+                break;
+            send_ready.wait_until(lock, first_queued + SEND_DELAY, [this] {
+                return outgoing.size() >= SEND_BATCH or !sending;
+            });
+            batch.swap(outgoing);
+            lock.unlock();
+
+            boost::system::error_code error;
+            boost::asio::write(socket, boost::asio::buffer(batch), error);
+            batch.clear();
+
+            lock.lock();
+            if (error) {
+                // spojenie je prec, koniec zisti aj receive_loop
+                sending = false;
+                outgoing.clear();
+                break;
+            }
+        }
+    }
+
     boost::asio::io_context io_context;
     tcp::socket socket;
 
     bool connected;
 
     const char* address;
+    std::string document_name;
     static const std::string PORT;
 
-    std::vector<char> buff;
-    static const size_t MAX_BUFF_LENGTH;
-
     size_t id;
+    // Prijate bajty, este nepouzite frame-y
+    Protocol::Frame_decoder decoder;
+
+    // Zaradene frame-y, odosiela ich iba sender
+    std::mutex send_mtx;
+    std::condition_variable send_ready;
+    std::string outgoing;
+    std::chrono::steady_clock::time_point first_queued;
+    bool sending;
+    std::thread sender;
+
+    static constexpr std::chrono::milliseconds SEND_DELAY
+        = std::chrono::milliseconds(2);
+    // Vacsia davka ide hned
+    static const size_t SEND_BATCH = 64 << 10;
 };
 
 const std::string Tcp_client::PORT = "6969";
-const size_t Tcp_client::MAX_BUFF_LENGTH = 10000;
 
 struct Window {
     explicit Window(Tcp_client* tcp_client)
         : tcp_client(tcp_client)
+        , id(tcp_client->get_id())
+        , sequence(0)
+        , top(0)
+        , left(0)
+        , requested(SIZE_MAX)
     {
         initscr();
         noecho();
@@ -124,9 +260,15 @@ struct Window {
     void input_loop()
     {
         for (;;) {
-            printw("%d", KEY_UP);
             int ch = getch();
             std::string message;
+            if (ch == KEY_RESIZE) {
+                // nova velkost, nakresli sa cele okno
+                std::lock_guard<std::mutex> lock(mtx);
+                rows.clear();
+                redraw();
+                continue;
+            }
 
             message = "S";
             switch (ch) {
@@ -160,53 +302,123 @@ struct Window {
             case '\t':
                 message += "T";
                 break;
+            // so shiftom sa vyber rozsiruje
+            case KEY_SR:
+                message = "KU";
+                break;
+            case KEY_SF:
+                message = "KD";
+                break;
+            case KEY_SRIGHT:
+                message = "KR";
+                break;
+            case KEY_SLEFT:
+                message = "KL";
+                break;
+            case KEY_SHOME:
+                message = "KH";
+                break;
+            case KEY_SEND:
+                message = "KE";
+                break;
+            // Ctrl-U a Ctrl-R ako vo vim, Ctrl-Z by v cbreak zastavil klienta
+            case 'U' & 0x1f:
+                message = "ZU";
+                break;
+            case 'R' & 0x1f:
+                message = "ZR";
+                break;
             default:
                 message = "W";
                 message += ch;
                 break;
             }
 
-            tcp_client->send_message(message);
+            // vlastny prikaz sa zobrazi hned, nepocka na server
+            uint64_t sent;
+            {
+                std::lock_guard<std::mutex> lock(mtx);
+                sent = ++sequence;
+                pending.push_back(Pending_command { sent, message });
+                redraw();
+            }
+            tcp_client->send_command(sent, message);
         }
     }
 
-    void print_document_image(Document::Document_image& document_image, int id)
+    // Nakresli iba viditelne riadky obrazu a z nich iba tie, ktore sa od
+    //  minuleho obrazu zmenili. Okno ide za vlastnym cursorom. Obraz je
+    //  iba okno dokumentu, riadky mimo neho su prazdne, kym nepridu.
+    void print_document_image(
+        const Document::Document_image& document_image, int id)
     {
-        clear();
-
-        auto closest_cursor = document_image.cursors.begin();
-        bool no_cursors_left = false;
-        for (size_t line_index = 0; line_index < document_image.data.size();
-             ++line_index) {
-            std::string& line = document_image.data.at(line_index);
-            for (size_t col = 0; col < line.size() + 1; ++col) {
-                int index_of_cursor_on_this_place = -1;
-                if (!no_cursors_left) {
-                    while (closest_cursor->line < line_index)
-                        ++closest_cursor;
-                    if (closest_cursor != document_image.cursors.end())
-                        while ((closest_cursor->line == line_index)
-                            and (closest_cursor->column == col)) {
-                            if (index_of_cursor_on_this_place != id)
-                                index_of_cursor_on_this_place
-                                    = closest_cursor->id;
-                            if (closest_cursor != document_image.cursors.end())
-                                ++closest_cursor;
-                            else
-                                no_cursors_left = true;
-                        }
+        size_t height = std::max(LINES, 1), width = std::max(COLS, 1);
+        if (rows.size() != height) {
+            rows.assign(height, Row());
+            clear();
+        }
+
+        // vlastny vyber sa podciarkne
+        Document::Position selection_start, selection_end, head;
+        bool found = false;
+        for (auto&& c : document_image.cursors)
+            if (int(c.id) == id) {
+                found = true;
+                head = { c.line, c.column };
+                selection_start = { c.anchor_line, c.anchor_column };
+                selection_end = head;
+                if (selection_end < selection_start)
+                    std::swap(selection_start, selection_end);
+            }
+        // vlastny cursor mimo okna, replika vie aspon jeho riadok
+        if (!found)
+            replica.head(id, head);
+        scroll_to(head, height, width);
+        request_viewport(document_image, height);
+
+        const auto& cursors = document_image.cursors;
+        auto cursor = cursors.begin();
+        size_t first = document_image.first;
+        size_t count = document_image.lines->lines_count();
+        for (size_t row = 0; row < height; ++row) {
+            size_t line_index = top + row;
+            Row next;
+            if (line_index >= first and line_index - first < count) {
+                std::string line
+                    = document_image.lines->line(line_index - first);
+                // za koncom riadku je este bunka pre cursor
+                line += ' ';
+                if (left < line.size())
+                    next.text = line.substr(left, width);
+
+                std::vector<chtype> attributes(next.text.size(), A_NORMAL);
+                for (size_t i = 0; i < attributes.size(); ++i) {
+                    Document::Position here(line_index, left + i);
+                    if (selection_start <= here and here < selection_end)
+                        attributes[i] |= A_UNDERLINE;
+                }
+                // cursory su zoradene, na jednom mieste vyhra vlastny
+                while (cursor != cursors.end() and cursor->line < line_index)
+                    ++cursor;
+                for (; cursor != cursors.end() and cursor->line == line_index;
+                     ++cursor) {
+                    if (cursor->column < left
+                        or cursor->column - left >= attributes.size())
+                        continue;
+                    chtype& cell = attributes[cursor->column - left];
+                    if (!(cell & A_REVERSE))
+                        cell = (cell & A_UNDERLINE)
+                            | get_cursor_attribute(cursor->id, id);
                 }
 
-                chtype cursor_attribute
-                    = get_cursor_attribute(index_of_cursor_on_this_place, id);
-                attron(cursor_attribute);
-                if (col == line.size())
-                    printw(" ");
-                else
-                    printw("%c", line[col]);
-                attroff(cursor_attribute);
+                for (size_t i = 0; i < attributes.size(); ++i)
+                    if (i == 0 or attributes[i] != attributes[i - 1])
+                        next.runs.emplace_back(i, attributes[i]);
             }
-            printw("\n");
+            if (next == rows[row])
+                continue;
+            draw_row(row, next);
+            rows[row] = std::move(next);
         }
 
         refresh();
@@ -219,37 +431,170 @@ struct Window {
         return COLOR_PAIR((cursor_id % 5) + 1);
     }
 
-    void printw_buff(const std::vector<char>& buff, int id)
+    // Vykresleny riadok obrazovky: text a od ktorej bunky plati atribut
+    struct Row {
+        std::string text;
+        std::vector<std::pair<size_t, chtype>> runs;
+
+        bool operator==(const Row& other) const
+        {
+            return text == other.text and runs == other.runs;
+        }
+    };
+
+    // Riadok sa kresli po usekoch s rovnakym atributom, zvysok sa zmaze
+    void draw_row(size_t row, const Row& next)
     {
-        std::stringstream ss;
-        ss.write(buff.data(), buff.size());
-        Document::Document_image document_image(ss.str());
+        move(int(row), 0);
+        for (size_t i = 0; i < next.runs.size(); ++i) {
+            size_t begin = next.runs[i].first;
+            size_t end = i + 1 < next.runs.size() ? next.runs[i + 1].first
+                                                  : next.text.size();
+            attrset(next.runs[i].second);
+            addnstr(next.text.data() + begin, int(end - begin));
+        }
+        attrset(A_NORMAL);
+        // posledny stlpec posunie kurzor na dalsi riadok, ten uz je cely
+        if (next.text.size() < size_t(COLS))
+            clrtoeol();
+    }
 
-        print_document_image(document_image, id);
+    // Posunie okno, aby bol vlastny cursor viditelny
+    void scroll_to(Document::Position head, size_t height, size_t width)
+    {
+        size_t old_top = top, old_left = left;
+        if (head.first < top)
+            top = head.first;
+        else if (head.first >= top + height)
+            top = head.first - height + 1;
+        if (head.second < left)
+            left = head.second;
+        else if (head.second >= left + width)
+            left = head.second - width + 1;
+        // po posune sa nic z minuleho obrazu nezhoduje, erase na rozdiel
+        //  od clear neprekresli pri refresh celu obrazovku
+        if (top != old_top or left != old_left) {
+            rows.assign(height, Row());
+            erase();
+        }
+    }
+
+    // Ked obrazovke zostava do kraja okna menej ako jedna obrazovka
+    //  riadkov, vypyta si okno okolo nej. Rovnaku ziadost neopakuje.
+    void request_viewport(
+        const Document::Document_image& document_image, size_t height)
+    {
+        size_t first = document_image.first;
+        size_t end = first + document_image.lines->lines_count();
+        bool before = first > 0 and top < first + height;
+        bool after = end < document_image.total and top + 2 * height > end;
+        if ((before or after) and top != requested) {
+            requested = top;
+            tcp_client->send_viewport(top, height);
+        }
+    }
+
+    void printw_buff(Protocol::Message_type type,
+        std::shared_ptr<const std::string> payload, int /*id*/)
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        // obraz nahradi repliku, delty sa na nu aplikuju
+        if (type == Protocol::Message_type::Image) {
+            replica.reset(Document::Document_image(payload));
+            requested = SIZE_MAX;
+        }
+        else if (type == Protocol::Message_type::Delta) {
+            const char* begin = payload->data();
+            if (!replica.apply(
+                    Document::Delta(begin, begin + payload->size())))
+                tcp_client->send_resync();
+        }
+        if (!replica.synced)
+            return;
+
+        // co server potvrdil, uz je v replike
+        auto own = replica.sequences.find(id);
+        uint64_t acknowledged
+            = own == replica.sequences.end() ? 0 : own->second;
+        while (!pending.empty() and pending.front().sequence <= acknowledged)
+            pending.pop_front();
+        redraw();
     }
 
 private:
+    struct Pending_command {
+        uint64_t sequence;
+        std::string message;
+    };
+
+    // Replika podla servera a na nej znova vsetky nepotvrdene prikazy.
+    //  Verzia repliky a posledny potvrdeny prikaz hovoria, co z vlastnych
+    //  prikazov uz server zapocital, zvysok sa predpoveda. Rope sa pri
+    //  kopii nekopiruje, predpoved stoji iba nepotvrdene prikazy. Mimo
+    //  okna sa nepredpoveda, prikazy sa ukazu az z delty.
+    void redraw()
+    {
+        if (!replica.synced)
+            return;
+        Document::Document_image document_image = replica.image();
+        bool visible = replica.cursors.count(id) != 0;
+        if (!pending.empty() and visible) {
+            predicted.reset(document_image);
+            for (auto&& command : pending)
+                predicted.process_message(id, command.message);
+            document_image = predicted.get_document_image();
+        }
+        print_document_image(document_image, id);
+    }
+
     Tcp_client* tcp_client;
+    const int id;
+
+    // Vlakno vstupu aj prijimania, replika, predpoved a obrazovka
+    std::mutex mtx;
+    Document::Replica replica;
+    Document::Document_handler predicted;
+    std::deque<Pending_command> pending;
+    uint64_t sequence;
+
+    // Co je na obrazovke: riadky od top, stlpce od left
+    std::vector<Row> rows;
+    size_t top, left;
+    // top z poslednej ziadosti o okno
+    size_t requested;
 };
 
 int main(int argc, char* argv[])
 {
     try {
-        if (argc != 2) {
-            std::cerr << "Usage: client <host>" << std::endl;
+        if (argc != 2 and argc != 3) {
+            std::cerr << "Usage: client <host> [document]" << std::endl;
             return 1;
         }
 
-        Tcp_client tcp_client(argv[1]);
-        if (!tcp_client.connect())
+        std::string document_name = argc == 3 ? argv[2] : "default";
+        if (!Protocol::valid_document_name(document_name)) {
+            std::cerr << "Invalid document name " << document_name
+                      << std::endl;
+            return 1;
+        }
+
+        // vyska terminalu pre prve okno, bez nej pride cely dokument
+        winsize size {};
+        ioctl(STDOUT_FILENO, TIOCGWINSZ, &size);
+
+        Tcp_client tcp_client(argv[1], document_name);
+        if (!tcp_client.connect(size.ws_row))
             return 1;
 
         Window window(&tcp_client);
 
-        std::function<void(std::vector<char>, int)> f
-            = [&window](const std::vector<char>& buff, int id) {
-                  window.printw_buff(buff, id);
-              };
+        std::function<void(Protocol::Message_type,
+            std::shared_ptr<const std::string>, int)>
+            f = [&window](Protocol::Message_type type,
+                    std::shared_ptr<const std::string> payload, int id) {
+                window.printw_buff(type, std::move(payload), id);
+            };
         boost::thread t1(
             boost::bind(&Tcp_client::receive_loop, &tcp_client, f));
         boost::thread t2(boost::bind(&Window::input_loop, &window));
@@ -1,24 +1,116 @@
 #include <algorithm>
 #include <iostream>
-#include <mutex>
-#include <sstream>
 #include <string>
 #include <vector>
 
 #include "document.h"
+#include "file.h"
+#include "rope.h"
+#include "undo.h"
 
 namespace Document {
 
 Document::Document()
-    : data(std::vector<std::string>(1))
+    : Document(Storage_type::Rope)
 {
 }
 
-size_t Document::lines_count() const { return data.size(); }
+Document::Document(Storage_type type)
+    : storage(make_storage(type))
+    , type(type)
+    , journal(nullptr)
+    , edits(nullptr)
+    , fixed(nullptr)
+{
+}
+
+size_t Document::lines_count() const { return storage->lines_count(); }
 
 size_t Document::line_length(size_t line) const
 {
-    return (line >= lines_count()) ? 0 : data[line].length();
+    return (line >= lines_count()) ? 0 : storage->line_length(line);
+}
+
+std::string Document::line(size_t line) const
+{
+    return (line >= lines_count()) ? "" : storage->line(line);
+}
+
+std::string Document::text(Position start, Position end) const
+{
+    std::string out;
+    if (lines_count() == 0 or end <= start)
+        return out;
+    end.first = std::min(end.first, lines_count() - 1);
+    for (size_t line = start.first; line <= end.first; ++line) {
+        std::string content = this->line(line);
+        size_t from = (line == start.first) ? start.second : 0;
+        size_t to = (line == end.first) ? end.second : content.size();
+        if (from < content.size())
+            out.append(content, from, std::min(to, content.size()) - from);
+        if (line != end.first)
+            out += '\n';
+    }
+    return out;
+}
+
+size_t Document::memory_usage() const { return storage->memory_usage(); }
+
+void Document::open(const std::string& path)
+{
+    // subor sa nekopiruje, ulozisko si drzi namapovany index riadkov
+    auto index = std::make_shared<Line_index>(
+        std::make_shared<Mapped_file>(path));
+    storage = make_storage(type);
+    storage->load(index);
+}
+
+void Document::save(const std::string& path) const { storage->save(path); }
+
+std::shared_ptr<const Storage> Document::snapshot() const
+{
+    return storage->snapshot();
+}
+
+void Document::apply(const Operation& operation)
+{
+    switch (operation.type) {
+    case Operation::Type::Insert_char:
+        insert_char(operation.line, operation.column, operation.text[0]);
+        break;
+    case Operation::Type::Delete_char:
+        delete_char(operation.line, operation.column);
+        break;
+    case Operation::Type::Break_line:
+        break_line(operation.line, operation.column);
+        break;
+    case Operation::Type::Insert_line:
+        insert_line(operation.line, operation.text);
+        break;
+    case Operation::Type::Delete_line:
+        delete_line(operation.line);
+        break;
+    case Operation::Type::Join_lines:
+        delete_char(operation.line, line_length(operation.line));
+        break;
+    case Operation::Type::Replace_text:
+        replace_text(operation.line, operation.column, operation.length,
+            operation.text);
+        break;
+    case Operation::Type::Replace_range:
+        replace_range({ operation.line, operation.column },
+            { operation.end_line, operation.end_column }, operation.text);
+        break;
+    default:
+        break;
+    }
+}
+
+bool Mark_order::operator()(const Mark* a, const Mark* b) const
+{
+    if (a->line == b->line)
+        return a->column < b->column;
+    return a->line < b->line;
 }
 
 void Document::insert_line(size_t line, const std::string& content = "")
@@ -26,28 +118,65 @@ void Document::insert_line(size_t line, const std::string& content = "")
     if (line > lines_count())
         line = lines_count();
 
-    data.insert(data.begin() + line, content);
+    if (edits) {
+        if (line < lines_count())
+            edits->push_back(Edit { { line, 0 }, "", content + "\n" });
+        else if (line > 0)
+            edits->push_back(Edit { { line - 1, line_length(line - 1) }, "",
+                "\n" + content });
+    }
+    storage->insert_line(line, content);
+    shift_marks({ line, 0 }, { line, 0 }, { line + 1, 0 });
+    if (journal)
+        journal->push_back(Operation::insert_line(line, content));
 }
 
 void Document::delete_line(size_t line)
 {
-    if (line < lines_count())
-        data.erase(data.begin() + line);
+    if (line < lines_count()) {
+        // posledny riadok zmaze aj koniec predosleho
+        if (line + 1 < lines_count() or line == 0) {
+            if (edits and line + 1 < lines_count())
+                edits->push_back(
+                    Edit { { line, 0 }, this->line(line) + "\n", "" });
+            shift_marks({ line, 0 }, { line + 1, 0 }, { line, 0 });
+        } else {
+            if (edits)
+                edits->push_back(Edit { { line - 1, line_length(line - 1) },
+                    "\n" + this->line(line), "" });
+            shift_marks({ line - 1, line_length(line - 1) },
+                { line, line_length(line) },
+                { line - 1, line_length(line - 1) });
+        }
+        storage->delete_line(line);
+        if (journal)
+            journal->push_back(Operation::delete_line(line));
+    }
 }
 
 void Document::break_line(size_t line, size_t column)
 {
     if (line < lines_count()) {
-        std::string new_line = data[line].substr(column);
-        data.insert(data.begin() + line + 1, new_line);
-        data[line] = data[line].substr(0, column);
+        column = std::min(column, line_length(line));
+        storage->break_line(line, column);
+        shift_marks({ line, column }, { line, column }, { line + 1, 0 });
+        if (edits)
+            edits->push_back(Edit { { line, column }, "", "\n" });
+        if (journal)
+            journal->push_back(Operation::break_line(line, column));
     }
 }
 
 void Document::insert_char(size_t line, size_t column, char ch)
 {
     if (line < lines_count()) {
-        data[line].insert(data[line].begin() + column, 1, ch);
+        column = std::min(column, line_length(line));
+        storage->insert_char(line, column, ch);
+        shift_marks({ line, column }, { line, column }, { line, column + 1 });
+        if (edits)
+            edits->push_back(Edit { { line, column }, "", std::string(1, ch) });
+        if (journal)
+            journal->push_back(Operation::insert_char(line, column, ch));
     }
 }
 
@@ -57,54 +186,197 @@ void Document::delete_char(size_t line, size_t column)
         // line musi byt v rangi
         if ((column == line_length(line)) and (line + 1 < lines_count())) {
             // ak mazeme na konci riadku, musime vymazat line break
-            std::string current_line_content = data[line + 1];
-            data.erase(data.begin() + line + 1);
-            data[line] += current_line_content;
+            if (edits)
+                edits->push_back(Edit { { line, column }, "\n", "" });
+            storage->join_lines(line);
+            shift_marks({ line, column }, { line + 1, 0 }, { line, column });
+            // replika bez riadku z operacie vidi, ze ubudol riadok
+            if (journal)
+                journal->push_back(Operation::join_lines(line));
 
-        } else if (column < line_length(line))
-            data[line].erase(column, 1);
+        } else if (column < line_length(line)) {
+            if (edits)
+                edits->push_back(Edit { { line, column },
+                    std::string(1, storage->line(line)[column]), "" });
+            storage->delete_char(line, column);
+            shift_marks(
+                { line, column }, { line, column + 1 }, { line, column });
+            if (journal)
+                journal->push_back(Operation::delete_char(line, column));
+        }
     }
 }
 
-void Cursor::set(size_t _line, size_t _column)
+Position Document::replace_text(
+    size_t line, size_t column, size_t length, std::string_view text)
 {
-    line = _line;
-    column = _column;
+    if (line >= lines_count())
+        return { line, column };
+    column = std::min(column, line_length(line));
+
+    // koniec mazaneho rozsahu, najviac po koniec dokumentu
+    size_t end_line = line, end_column = column, deleted = 0;
+    while (deleted < length) {
+        size_t rest = line_length(end_line) - end_column;
+        if (length - deleted <= rest) {
+            end_column += length - deleted;
+            deleted = length;
+        } else if (end_line + 1 == lines_count()) {
+            end_column += rest;
+            deleted += rest;
+            break;
+        } else {
+            deleted += rest + 1;
+            ++end_line;
+            end_column = 0;
+        }
+    }
+    return replace({ line, column }, { end_line, end_column }, text);
 }
-void Cursor::set(const Cursor& other) { set(other.line, other.column); }
 
-Cursor::Cursor()
-    : line(0)
-    , column(0)
-    , document(nullptr)
+Position Document::insert_text(
+    size_t line, size_t column, std::string_view text)
 {
+    return replace_text(line, column, 0, text);
 }
 
-Cursor::Cursor(Document* document)
-    : line(0)
-    , column(0)
-    , document(document)
+void Document::delete_text(size_t line, size_t column, size_t length)
 {
+    replace_text(line, column, length, {});
 }
 
-Cursor::Cursor(Document* document, size_t _line, size_t _column)
-    : line(_line)
-    , column(_column)
-    , document(document)
+Position Document::replace_range(
+    Position start, Position end, std::string_view text)
+{
+    if (lines_count() == 0)
+        return start;
+    auto clamp = [this](Position& position) {
+        position.first = std::min(position.first, lines_count() - 1);
+        position.second
+            = std::min(position.second, line_length(position.first));
+    };
+    clamp(start);
+    clamp(end);
+    if (end < start)
+        std::swap(start, end);
+    return replace(start, end, text);
+}
+
+Position Document::replace(
+    Position start, Position end, std::string_view text)
+{
+    if (start == end and text.empty())
+        return start;
+    if (edits)
+        edits->push_back(
+            Edit { start, this->text(start, end), std::string(text) });
+
+    // zo zasiahnutych riadkov ostane zaciatok prveho a koniec posledneho,
+    //  medzi ne pridu riadky textu
+    std::vector<std::string> content(
+        1, storage->line(start.first).substr(0, start.second));
+    for (char ch : text)
+        if (ch == '\n')
+            content.emplace_back();
+        else
+            content.back() += ch;
+    Position new_end(start.first + content.size() - 1, content.back().size());
+    content.back() += storage->line(end.first).substr(end.second);
+    storage->replace_lines(start.first, end.first - start.first + 1, content);
+    shift_marks(start, end, new_end);
+
+    // koniec namiesto dlzky, replika tak nepotrebuje mazane riadky
+    if (journal)
+        journal->push_back(Operation::replace_range(start.first, start.second,
+            end.first, end.second, std::string(text)));
+    return new_end;
+}
+
+void Document::shift_marks(Position start, Position end, Position new_end)
+{
+    shift_marks(heads, start, end, new_end);
+    shift_marks(anchors, start, end, new_end);
+    for (Mark_set* set : marks)
+        if (set != fixed)
+            shift_marks(*set, start, end, new_end);
+}
+
+void Document::shift_marks(
+    Mark_set& marks, Position start, Position end, Position new_end)
 {
+    Mark probe { start.first, start.second, {} };
+    for (auto it = marks.lower_bound(&probe); it != marks.end(); ++it) {
+        Mark& mark = **it;
+        Position position(mark.line, mark.column);
+        if (position < end) {
+            // zmazany text
+            mark.line = start.first;
+            mark.column = start.second;
+        } else if (mark.line == end.first) {
+            mark.column = new_end.second + (mark.column - end.second);
+            mark.line = new_end.first;
+        } else if (new_end.first == end.first)
+            // dalsie riadky sa neposunuli
+            break;
+        else
+            mark.line = mark.line + new_end.first - end.first;
+    }
 }
-Cursor::Cursor(Document* document, const Cursor& other)
-    : line(other.line)
-    , column(other.column)
+
+Cursor::Cursor(Document* document, size_t id)
+    : Mark { 0, 0, {} }
+    , anchor { 0, 0, {} }
     , document(document)
+    , id(id)
+    , sequence(0)
 {
+    entry = document->heads.insert(this);
+    anchor.entry = document->anchors.insert(&anchor);
 }
 
+Cursor::~Cursor()
+{
+    document->heads.erase(entry);
+    document->anchors.erase(anchor.entry);
+}
+
+void Cursor::set(size_t _line, size_t _column)
+{
+    if (line == _line and column == _column)
+        return;
+    document->heads.erase(entry);
+    line = _line;
+    column = _column;
+    entry = document->heads.insert(this);
+}
+
+void Cursor::set_anchor(size_t _line, size_t _column)
+{
+    if (anchor.line == _line and anchor.column == _column)
+        return;
+    document->anchors.erase(anchor.entry);
+    anchor.line = _line;
+    anchor.column = _column;
+    anchor.entry = document->anchors.insert(&anchor);
+}
+
+bool Cursor::has_selection() const
+{
+    return anchor.line != line or anchor.column != column;
+}
+
+void Cursor::collapse() { set_anchor(line, column); }
+
 void Cursor::sync_with_document()
 {
-    if (line >= document->lines_count())
-        return set(document->lines_count() - 1,
-            document->line_length(document->lines_count() - 1));
+    size_t last = document->lines_count() - 1;
+    if (anchor.line > last)
+        set_anchor(last, document->line_length(last));
+    else if (anchor.column > document->line_length(anchor.line))
+        set_anchor(anchor.line, document->line_length(anchor.line));
+
+    if (line > last)
+        return set(last, document->line_length(last));
 
     size_t new_column = std::min(column, document->line_length(line));
     set(line, new_column);
@@ -164,25 +436,31 @@ void Cursor::right()
         set(line, column + 1);
 }
 
+// Vlozenie na mieste hlavy posunie hlavu aj kotvu za vlozeny text
+
 void Cursor::write(char ch)
 {
     sync_with_document();
-    document->insert_char(line, column, ch);
-    right();
+    if (!replace_selection(std::string_view(&ch, 1)))
+        document->insert_char(line, column, ch);
 }
 
 void Cursor::del()
 {
     // TODO: delete na konci riadku nemaze newline
     sync_with_document();
-    document->delete_char(line, column);
+    if (!replace_selection({}))
+        document->delete_char(line, column);
 }
 
 void Cursor::backspace()
 {
+    sync_with_document();
+    if (replace_selection({}))
+        return;
     if ((line != 0) or (column != 0)) {
-        sync_with_document();
         left();
+        collapse();
         del();
     }
 }
@@ -190,124 +468,512 @@ void Cursor::backspace()
 void Cursor::break_line()
 {
     sync_with_document();
-    document->break_line(line, column);
-    down();
-    home();
+    if (!replace_selection("\n"))
+        document->break_line(line, column);
 }
 
 void Cursor::tab()
 {
+    sync_with_document();
     size_t amount_of_spaces = ((column + 4) / 4) * 4 - column;
-    for (size_t i = 0; i < amount_of_spaces; ++i) {
-        write(' ');
-    }
+    insert_text(std::string(amount_of_spaces, ' '));
+}
+
+void Cursor::insert_text(std::string_view text)
+{
+    sync_with_document();
+    if (!replace_selection(text))
+        replace_text(0, text);
+}
+
+void Cursor::delete_text(size_t length)
+{
+    sync_with_document();
+    document->delete_text(line, column, length);
+}
+
+void Cursor::replace_text(size_t length, std::string_view text)
+{
+    sync_with_document();
+    Position end = document->replace_text(line, column, length, text);
+    set(end.first, end.second);
+}
+
+bool Cursor::replace_selection(std::string_view text)
+{
+    if (!has_selection())
+        return false;
+    Position end = document->replace_range(
+        { anchor.line, anchor.column }, { line, column }, text);
+    set(end.first, end.second);
+    collapse();
+    return true;
 }
 
 Cursor_image::Cursor_image()
     : line(0)
     , column(0)
     , id(-1)
+    , anchor_line(0)
+    , anchor_column(0)
+    , sequence(0)
 {
 }
 
-Cursor_image::Cursor_image(size_t line, size_t column, size_t id)
+Cursor_image::Cursor_image(size_t line, size_t column, size_t id,
+    size_t anchor_line, size_t anchor_column, uint64_t sequence)
     : line(line)
     , column(column)
     , id(id)
+    , anchor_line(anchor_line)
+    , anchor_column(anchor_column)
+    , sequence(sequence)
 {
 }
 
-bool Cursor_image::operator<(const Cursor_image& other)
+bool Cursor_image::operator<(const Cursor_image& other) const
 {
-    if (line == other.line)
+    if (line != other.line)
+        return line < other.line;
+    if (column != other.column)
         return column < other.column;
-    return line < other.line;
+    return id < other.id;
 }
 
-Document_image::Document_image() = default;
+Document_image::Document_image()
+    : version(0)
+    , first(0)
+    , total(0)
+{
+}
 
-// Regular constructor, serializes the object
-Document_image::Document_image(const std::vector<std::string>& data,
-    const std::vector<Cursor_image>& cursors)
-    : data(data)
-    , cursors(cursors)
+// Regular constructor, only keeps the snapshot, encode() serializes it
+Document_image::Document_image(std::shared_ptr<const Storage> lines,
+    std::vector<Cursor_image> cursors, uint64_t version, size_t first,
+    size_t total)
+    : lines(std::move(lines))
+    , cursors(std::move(cursors))
+    , version(version)
+    , first(first)
+    , total(total)
 {
-    // aby sme mohli garantovat usortenie cursorov
-    sort_cursors();
+}
 
-    std::stringstream ss;
-    ss << cursors.size() << "\n";
-    for (auto&& c : cursors)
-        ss << c.line << " " << c.column << " " << c.id << "\n";
-    ss << data.size() << "\n";
-    for (auto&& line : data)
-        ss << line << "\n";
-    serialized_object = ss.str();
-}
-// Constructor from string, deserializes the object
-Document_image::Document_image(const std::string& serialized_object)
-    : serialized_object(serialized_object)
-{
-    std::stringstream ss(serialized_object);
-    size_t cursors_count;
-    ss >> cursors_count;
-    cursors.resize(cursors_count);
-    for (size_t i = 0; i < cursors_count; ++i) {
-        size_t line, column, id;
-        ss >> line >> column >> id;
-        cursors[i] = Cursor_image(line, column, id);
+namespace {
+    // Hlavy su v dokumente zoradene, prechod nimi staci, podla id sa
+    //  triedia iba cursory na rovnakom mieste. Riadky dokumentu zacinaju
+    //  riadkom first.
+    std::vector<Cursor_image> sorted_cursors(
+        const Mark_set& heads, size_t first)
+    {
+        std::vector<Cursor_image> images;
+        images.reserve(heads.size());
+        for (const Mark* head : heads) {
+            auto cursor = static_cast<const Cursor*>(head);
+            images.emplace_back(first + cursor->line, cursor->column,
+                cursor->id, first + cursor->anchor.line, cursor->anchor.column,
+                cursor->sequence);
+        }
+        for (auto begin = images.begin(); begin != images.end();) {
+            auto end = begin + 1;
+            while (end != images.end() and end->line == begin->line
+                and end->column == begin->column)
+                ++end;
+            if (end - begin > 1)
+                std::sort(begin, end);
+            begin = end;
+        }
+        return images;
     }
-    size_t data_size;
-    ss >> data_size;
-    data.resize(data_size);
 
-    // Treba nacitat koniec tohoto riadka, dalsie veci treba citat getlinom, ale
-    //  este stale som na riadku s poctom riadkov
-    std::string dummy_variable;
-    getline(ss, dummy_variable);
+    // Riadky prijateho obrazu, ukazuju priamo do bufferu spravy
+    class Payload_lines : public Line_source {
+    public:
+        explicit Payload_lines(std::shared_ptr<const std::string> payload)
+            : payload(std::move(payload))
+        {
+        }
+
+        size_t lines_count() const override { return lines.size(); }
+        std::string_view line(size_t line) const override
+        {
+            return lines[line];
+        }
 
-    for (size_t i = 0; i < data_size; ++i)
-        getline(ss, data[i]);
+        std::shared_ptr<const std::string> payload;
+        std::vector<std::string_view> lines;
+    };
+
+    // Kopia casti riadkov pre obraz okna
+    class Copied_lines : public Line_source {
+    public:
+        size_t lines_count() const override { return lines.size(); }
+        std::string_view line(size_t line) const override
+        {
+            return lines[line];
+        }
+
+        std::vector<std::string> lines;
+    };
+}
+
+// Constructor from payload, deserializes the object without copying lines
+Document_image::Document_image(std::shared_ptr<const std::string> payload)
+{
+    Protocol::Reader reader(payload->data(), payload->data() + payload->size());
+    version = reader.varint();
+    first = reader.varint();
+    total = reader.varint();
+    cursors.resize(reader.varint());
+    for (auto&& c : cursors) {
+        size_t line = reader.varint();
+        size_t column = reader.varint();
+        size_t id = reader.varint();
+        size_t anchor_line = reader.varint();
+        size_t anchor_column = reader.varint();
+        uint64_t sequence = reader.varint();
+        c = Cursor_image(
+            line, column, id, anchor_line, anchor_column, sequence);
+    }
+
+    auto source = std::make_shared<Payload_lines>(payload);
+    source->lines.resize(reader.varint());
+    if (source->lines.empty())
+        throw Protocol::Protocol_error("Image without lines");
+    if (first > total or source->lines.size() > total - first)
+        throw Protocol::Protocol_error("Image window outside document");
+    for (auto&& line : source->lines)
+        line = reader.text();
+
+    auto rope = std::make_shared<Rope_storage>();
+    rope->load(source);
+    lines = std::move(rope);
 
     // aby sme mohli garantovat usortenie cursorov
     sort_cursors();
 }
 
+void Document_image::encode(Protocol::Chunked_message& out) const
+{
+    using Protocol::put_varint;
+
+    std::string header;
+    put_varint(header, version);
+    put_varint(header, first);
+    put_varint(header, total);
+    put_varint(header, cursors.size());
+    for (auto&& c : cursors) {
+        put_varint(header, c.line);
+        put_varint(header, c.column);
+        put_varint(header, c.id);
+        put_varint(header, c.anchor_line);
+        put_varint(header, c.anchor_column);
+        put_varint(header, c.sequence);
+    }
+    put_varint(header, lines->lines_count());
+    out.append(std::move(header));
+
+    // riadky su v cache uloziska, nemenene sa znova nekoduju
+    lines->encode_lines(out);
+}
+
 void Document_image::sort_cursors()
 {
     std::sort(cursors.begin(), cursors.end());
 }
 
-bool Document_handler::process_message(int cursor_id, std::string message)
+Replica::Replica()
+    : first(0)
+    , total(0)
+    , version(0)
+    , synced(false)
+{
+}
+
+void Replica::reset(const Document_image& image)
+{
+    // prijaty obraz je rope nad bufferom spravy, kopia je O(1)
+    document.storage = image.lines->copy();
+    first = image.first;
+    total = image.total;
+
+    cursors.clear();
+    outside.clear();
+    sequences.clear();
+    for (auto&& c : image.cursors) {
+        sequences[c.id] = c.sequence;
+        move_head(c.id, { c.line, c.column });
+        move_anchor(c.id, { c.anchor_line, c.anchor_column });
+    }
+
+    version = image.version;
+    synced = true;
+}
+
+bool Replica::apply(const Delta& delta)
+{
+    // bez obrazu alebo stara delta, ktoru uz obraz obsahuje
+    if (!synced or delta.version <= version)
+        return true;
+    if (delta.version != version + 1) {
+        synced = false;
+        return false;
+    }
+
+    for (auto&& operation : delta.operations) {
+        if (operation.edits_text()) {
+            if (!apply_text(operation)) {
+                synced = false;
+                return false;
+            }
+            continue;
+        }
+        size_t id = operation.cursor_id;
+        switch (operation.type) {
+        case Operation::Type::Move_cursor:
+            move_head(id, { operation.line, operation.column });
+            break;
+        case Operation::Type::Move_anchor:
+            move_anchor(id, { operation.line, operation.column });
+            break;
+        case Operation::Type::Remove_cursor:
+            cursors.erase(id);
+            outside.erase(id);
+            sequences.erase(id);
+            break;
+        case Operation::Type::Acknowledge: {
+            sequences[id] = operation.sequence;
+            auto it = cursors.find(id);
+            if (it != cursors.end())
+                it->second.sequence = operation.sequence;
+            break;
+        }
+        default:
+            break;
+        }
+    }
+    version = delta.version;
+    return true;
+}
+
+bool Replica::apply_text(const Operation& operation)
+{
+    // uprava meni old riadkov od line, po nej je na ich mieste added riadkov
+    size_t line = operation.line, old = 1, added = 1;
+    switch (operation.type) {
+    case Operation::Type::Break_line:
+        added = 2;
+        break;
+    case Operation::Type::Join_lines:
+        old = 2;
+        break;
+    case Operation::Type::Insert_line:
+        line = std::min(line, total);
+        old = 0;
+        break;
+    case Operation::Type::Delete_line:
+        // posledny riadok sa zmaze spolu s koncom predchadzajuceho
+        if (line + 1 == total and line > 0) {
+            --line;
+            old = 2;
+        } else
+            added = 0;
+        break;
+    case Operation::Type::Replace_range:
+        old = operation.end_line - line + 1;
+        added += std::count(operation.text.begin(), operation.text.end(), '\n');
+        break;
+    case Operation::Type::Replace_text:
+        // rozsah nie je z operacie vidno, ide iba s celym dokumentom
+        if (first != 0 or document.lines_count() != total)
+            return false;
+        document.apply(operation);
+        total = document.lines_count();
+        return true;
+    default:
+        break;
+    }
+
+    size_t end = line + old, count = document.lines_count();
+    if (line >= first and end <= first + count) {
+        // okno by ostalo bez riadkov, nevedelo by, kde v dokumente je
+        if (count + added == old and count != total)
+            return false;
+        Operation local = operation;
+        local.line -= first;
+        if (operation.type == Operation::Type::Replace_range)
+            local.end_line -= first;
+        document.apply(local);
+    } else if (end <= first)
+        first = first + added - old;
+    else if (line < first + count)
+        // uprava zasiahla okno aj riadky mimo neho
+        return false;
+
+    total = total + added - old;
+    for (auto&& head : outside)
+        if (head.second.first >= end)
+            head.second.first = head.second.first + added - old;
+    return true;
+}
+
+void Replica::move_head(size_t id, Position head)
+{
+    if (head.first < first or head.first >= first + document.lines_count()) {
+        cursors.erase(id);
+        outside[id] = head;
+        return;
+    }
+    outside.erase(id);
+    auto inserted = cursors.try_emplace(id, &document, id);
+    Cursor& cursor = inserted.first->second;
+    cursor.set(head.first - first, head.second);
+    if (inserted.second) {
+        cursor.collapse();
+        auto sequence = sequences.find(id);
+        if (sequence != sequences.end())
+            cursor.sequence = sequence->second;
+    }
+}
+
+void Replica::move_anchor(size_t id, Position anchor)
+{
+    auto it = cursors.find(id);
+    if (it == cursors.end())
+        return;
+    // kotva mimo okna sa prilepi na jeho okraj
+    size_t count = document.lines_count();
+    if (anchor.first < first)
+        it->second.set_anchor(0, 0);
+    else if (anchor.first >= first + count)
+        it->second.set_anchor(count - 1, document.line_length(count - 1));
+    else
+        it->second.set_anchor(anchor.first - first, anchor.second);
+}
+
+Document_image Replica::image() const
+{
+    return Document_image(document.snapshot(),
+        sorted_cursors(document.heads, first), version, first, total);
+}
+
+bool Replica::head(size_t id, Position& position) const
+{
+    auto it = cursors.find(id);
+    if (it != cursors.end()) {
+        position = { first + it->second.line, it->second.column };
+        return true;
+    }
+    auto out = outside.find(id);
+    if (out == outside.end())
+        return false;
+    position = out->second;
+    return true;
+}
+
+Document_handler::Document_handler(Storage_type type)
+    : document(type)
+    , undo_sequence(0)
+    , undo_memory(0)
+    , version(0)
+    , first(0)
+    , hidden(0)
+{
+}
+
+Document_handler::~Document_handler() = default;
+
+namespace {
+    // Pohyb hlavy podla smeru z prikazu S alebo K
+    bool move(Cursor& cursor, char direction)
+    {
+        switch (direction) {
+        case 'U':
+            cursor.up();
+            return true;
+        case 'D':
+            cursor.down();
+            return true;
+        case 'R':
+            cursor.right();
+            return true;
+        case 'L':
+            cursor.left();
+            return true;
+        case 'H':
+            cursor.home();
+            return true;
+        case 'E':
+            cursor.end();
+            return true;
+        }
+        return false;
+    }
+}
+
+bool Document_handler::process_message(
+    int cursor_id, const std::string& message)
 {
     Cursor* cursor = get_cursor(cursor_id);
     if (cursor == nullptr)
         return false;
+    if (message.size() < 2) {
+        std::cerr << "Message too short.\n";
+        return false;
+    }
+
+    // upravy dokumentu sa zapisu do dalsej delty a do undo cursora
+    document.journal = &pending.operations;
+    Undo_history& history = *histories.at(cursor_id);
+    size_t history_memory = history.memory();
+    edits.clear();
+    document.edits = &edits;
+    history.begin_edit();
+    size_t journalled = pending.operations.size();
+    Position old_head(cursor->line, cursor->column);
+    Position old_anchor(cursor->anchor.line, cursor->anchor.column);
 
+    bool valid = true;
     char first_char = message[0], second_char = message[1];
     switch (first_char) {
     case 'W':
         cursor->write(second_char);
         break;
+    case 'I':
+        // vlozenie celeho bloku (paste), zvysok spravy je text
+        cursor->insert_text(std::string_view(message).substr(1));
+        break;
+    case 'D':
+    case 'R':
+        try {
+            // varint pocet znakov, pri R za nim nahradny text
+            Protocol::Reader reader(
+                message.data() + 1, message.data() + message.size());
+            size_t length = reader.varint();
+            if (first_char == 'D')
+                cursor->delete_text(length);
+            else
+                cursor->replace_text(length, reader.rest());
+        } catch (Protocol::Protocol_error& e) {
+            std::cerr << "Invalid message: " << e.what() << "\n";
+            valid = false;
+        }
+        break;
+    case 'K':
+        // pohyb s vyberom, kotva ostane na mieste
+        if (!move(*cursor, second_char))
+            std::cerr << "Unknown message.\n";
+        break;
     case 'S':
         switch (second_char) {
         case 'U':
-            cursor->up();
-            break;
         case 'D':
-            cursor->down();
-            break;
         case 'R':
-            cursor->right();
-            break;
         case 'L':
-            cursor->left();
-            break;
         case 'H':
-            cursor->home();
-            break;
         case 'E':
-            cursor->end();
+            move(*cursor, second_char);
+            cursor->collapse();
             break;
         case 'B':
             cursor->break_line();
@@ -326,29 +992,159 @@ bool Document_handler::process_message(int cursor_id, std::string message)
             break;
         }
         break;
+    case 'Z':
+        // cely krok undo je jedna uprava, klienti ho dostanu v jednej delte
+        document.edits = nullptr;
+        if (second_char == 'U')
+            history.undo(*cursor);
+        else if (second_char == 'R')
+            history.redo(*cursor);
+        else
+            std::cerr << "Unknown message.\n";
+        break;
     default:
         std::cerr << "Unknown message.\n";
-        return false;
+        valid = false;
         break;
     }
 
+    document.edits = nullptr;
+    history.end_edit();
+    if (!valid)
+        return false;
+    for (auto&& edit : edits)
+        history.record(edit, old_head, ++undo_sequence);
+    if (edits.empty() and first_char != 'Z')
+        history.separate();
+    undo_memory = undo_memory - history_memory + history.memory();
+    trim_undo();
+
+    // uprava mohla posunut hlavu aj kotvu, replika ich posunie rovnako,
+    //  ale uprava pod inym cursorom ich tam nemusi zanechat
+    bool edited = pending.operations.size() != journalled;
+    if (edited or Position(cursor->line, cursor->column) != old_head)
+        pending.operations.push_back(
+            Operation::move_cursor(cursor_id, cursor->line, cursor->column));
+    if (edited
+        or Position(cursor->anchor.line, cursor->anchor.column) != old_anchor)
+        pending.operations.push_back(Operation::move_anchor(
+            cursor_id, cursor->anchor.line, cursor->anchor.column));
+
     return true;
 }
 
+void Document_handler::open(const std::string& path)
+{
+    document.open(path);
+    for (auto&& cp : cursors)
+        cp.second.sync_with_document();
+}
+
+void Document_handler::save(const std::string& path) const
+{
+    document.snapshot()->save(path);
+}
+
+void Document_handler::reset(const Document_image& image)
+{
+    histories.clear();
+    cursors.clear();
+    undo_memory = 0;
+    document.storage = image.lines->copy();
+    size_t count = document.lines_count();
+    first = image.first;
+    hidden = image.total - count;
+    for (auto&& c : image.cursors) {
+        if (c.line < first or c.line >= first + count)
+            continue;
+        Cursor& cursor
+            = cursors.try_emplace(c.id, &document, c.id).first->second;
+        cursor.set(c.line - first, c.column);
+        // kotva mimo okna na jeho okraji
+        if (c.anchor_line < first)
+            cursor.set_anchor(0, 0);
+        else if (c.anchor_line >= first + count)
+            cursor.set_anchor(count - 1, document.line_length(count - 1));
+        else
+            cursor.set_anchor(c.anchor_line - first, c.anchor_column);
+        cursor.sequence = c.sequence;
+        histories[c.id] = std::make_unique<Undo_history>(document);
+    }
+    version = image.version;
+    pending = Delta();
+    acknowledged.clear();
+}
+
+void Document_handler::replay(const Delta& delta)
+{
+    for (auto&& operation : delta.operations)
+        if (operation.edits_text())
+            document.apply(operation);
+    for (auto&& cp : cursors)
+        cp.second.sync_with_document();
+}
+
+void Document_handler::set_version(uint64_t version)
+{
+    this->version = version;
+}
+
+uint64_t Document_handler::get_version() const { return version; }
+
+std::shared_ptr<const Storage> Document_handler::snapshot() const
+{
+    return document.snapshot();
+}
+
+void Document_handler::acknowledge(int cursor_id, uint64_t sequence)
+{
+    auto it = cursors.find(cursor_id);
+    if (it != cursors.end() and it->second.sequence < sequence) {
+        it->second.sequence = sequence;
+        acknowledged.insert(cursor_id);
+    }
+}
+
 void Document_handler::add_new_cursor(int cursor_id)
 {
     if (cursors.find(cursor_id) != cursors.end())
         std::cerr << "Cursor with id " << cursor_id << " already exists.\n";
     else {
-        cursors[cursor_id] = Cursor(&document);
+        cursors.try_emplace(cursor_id, &document, cursor_id);
+        histories[cursor_id] = std::make_unique<Undo_history>(document);
+        pending.operations.push_back(Operation::move_cursor(cursor_id, 0, 0));
     }
 }
 
 void Document_handler::remove_cursor(int cursor_id)
 {
-    cursors.erase(cursor_id);
+    if (cursors.erase(cursor_id) != 0)
+        pending.operations.push_back(Operation::remove_cursor(cursor_id));
+    auto it = histories.find(cursor_id);
+    if (it != histories.end()) {
+        undo_memory -= it->second->memory();
+        histories.erase(it);
+    }
 }
 
+void Document_handler::trim_undo()
+{
+    while (undo_memory > UNDO_BUDGET) {
+        Undo_history* oldest = nullptr;
+        for (auto&& hp : histories)
+            if (!hp.second->empty()
+                and (!oldest or hp.second->oldest() < oldest->oldest()))
+                oldest = hp.second.get();
+        if (!oldest)
+            break;
+        size_t memory = oldest->memory();
+        oldest->drop_oldest();
+        undo_memory -= memory - oldest->memory();
+    }
+}
+
+size_t Document_handler::cursors_count() const { return cursors.size(); }
+
 Cursor* Document_handler::get_cursor(int cursor_id)
 {
     if (cursors.find(cursor_id) == cursors.end()) {
@@ -358,27 +1154,76 @@ Cursor* Document_handler::get_cursor(int cursor_id)
     return std::addressof(cursors.at(cursor_id));
 }
 
-Document_image Document_handler::get_document_image()
+Document_image Document_handler::get_document_image() const
+{
+    // obraz nadvazuje na poslednu odoslanu deltu, neodoslane operacie v nom
+    //  uz su, preto ich treba najprv odoslat cez take_delta
+    return Document_image(document.snapshot(),
+        sorted_cursors(document.heads, first), version, first,
+        document.lines_count() + hidden);
+}
+
+Document_image Document_handler::get_document_image(
+    size_t first, size_t count) const
+{
+    size_t lines = document.lines_count();
+    if (lines == 0 or (first == 0 and count >= lines))
+        return get_document_image();
+    first = std::min(first, lines - 1);
+    count = std::max<size_t>(std::min(count, lines - first), 1);
+
+    auto source = std::make_shared<Copied_lines>();
+    source->lines.reserve(count);
+    for (size_t line = first; line < first + count; ++line)
+        source->lines.push_back(document.line(line));
+    auto rope = std::make_shared<Rope_storage>();
+    rope->load(source);
+    return Document_image(std::move(rope), sorted_cursors(document.heads, 0),
+        version, first, lines);
+}
+
+Protocol::Chunked_message Document_handler::serialize() const
+{
+    Protocol::Chunked_message payload;
+    get_document_image().encode(payload);
+    return Protocol::frame(Protocol::Message_type::Image, payload);
+}
+
+Delta Document_handler::take_delta()
 {
-    std::vector<Cursor_image> cursor_images(cursors.size());
-    size_t i = 0;
-    for (auto&& cp : cursors) {
-        cursor_images[i]
-            = Cursor_image(cp.second.line, cp.second.column, cp.first);
-        ++i;
+    // potvrdenia idu za vsetky upravy, jedno za cursor
+    for (int id : acknowledged) {
+        auto it = cursors.find(id);
+        if (it != cursors.end())
+            pending.operations.push_back(
+                Operation::acknowledge(id, it->second.sequence));
     }
+    acknowledged.clear();
 
-    return Document_image(document.data, cursor_images);
+    Delta delta;
+    std::swap(delta, pending);
+    if (!delta.operations.empty())
+        delta.version = ++version;
+    return delta;
 }
 
-std::string Document_handler::serialize()
+std::string Document_handler::dump() const
 {
-    return get_document_image().serialized_object;
+    Document_image image = get_document_image();
+    std::string out = "version " + std::to_string(image.version) + "\n";
+    for (auto&& c : image.cursors)
+        out += std::to_string(c.line) + " " + std::to_string(c.column) + " "
+            + std::to_string(c.id) + "\n";
+    image.lines->for_each_line([&out](const Line_view& line) {
+        line.append_to(out);
+        out += "\n";
+    });
+    return out;
 }
 
-void Document_handler::print()
+Document_stats Document_handler::stats() const
 {
-    std::cout << "--------------------------------\n"
-              << serialize() << "--------------------------------\n";
+    return Document_stats { document.type, document.lines_count(),
+        document.memory_usage() + undo_memory, undo_memory };
 }
 }
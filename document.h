@@ -1,41 +1,127 @@
-#ifndef M_DOCUMNT
+#ifndef M_DOCUMENT
 #define M_DOCUMENT
 
 #include <iostream>
 #include <map>
-#include <mutex>
+#include <memory>
+#include <set>
 #include <string>
+#include <utility>
 #include <vector>
 
+#include "protocol.h"
+#include "storage.h"
+
 namespace Document {
 
+// Riadok a stlpec
+using Position = std::pair<size_t, size_t>;
+
+struct Mark;
+
+struct Mark_order {
+    bool operator()(const Mark* a, const Mark* b) const;
+};
+
+// Marky zoradene podla pozicie. Kazda uprava posuva pozicie monotonne,
+//  poradie markov sa nemeni, takze sa posuvaju priamo na mieste v mnozine.
+using Mark_set = std::multiset<Mark*, Mark_order>;
+
+// Pozicia v dokumente, ktoru Document po kazdej uprave posunie
+struct Mark {
+    size_t line, column;
+    // Zaznam v Document::heads, Document::anchors alebo mnozine z marks
+    Mark_set::iterator entry;
+};
+
+// Co jedna uprava zmenila: od start bol text removed, teraz je tam
+//  inserted. Koniec riadku je '\n'.
+struct Edit {
+    Position start;
+    std::string removed, inserted;
+};
+
 struct Document {
-    std::vector<std::string> data;
+    std::unique_ptr<Storage> storage;
+    Storage_type type;
+    // Ak nie je nullptr, kazda uprava sa sem zapise ako Operation
+    std::vector<Operation>* journal;
+    // Ak nie je nullptr, kazda uprava sem zapise, co nahradila
+    std::vector<Edit>* edits;
+    // Hlavy a kotvy vsetkych cursorov. Uprava posunie iba marky na mieste
+    //  upravy a za nim, O(log n + posunute).
+    Mark_set heads, anchors;
+    // Dalsie mnoziny markov (kroky undo), uprava posunie vsetky okrem fixed
+    std::vector<Mark_set*> marks;
+    const Mark_set* fixed;
 
     Document();
+    explicit Document(Storage_type type);
 
     // Document info
     size_t lines_count() const;
     size_t line_length(size_t line) const;
+    std::string line(size_t line) const;
+    // Text medzi dvoma poziciami, orezany na koniec dokumentu
+    std::string text(Position start, Position end) const;
+    size_t memory_usage() const;
+
+    // Persistence
+    void open(const std::string& path);
+    void save(const std::string& path) const;
+    // Nemenny pohlad na aktualny obsah, pre rope backend O(1)
+    std::shared_ptr<const Storage> snapshot() const;
 
     // Document modification
+    // Operacia, ktora meni text (edits_text), napr. z delty alebo logu
+    void apply(const Operation& operation);
     void insert_line(size_t line, const std::string& content);
     void delete_line(size_t line);
     void break_line(size_t line, size_t column);
     void insert_char(size_t line, size_t column, char ch);
     void delete_char(size_t line, size_t column);
+    // Jedna operacia pre cely blok textu, riadky sa vlozia aj zmazu naraz.
+    //  Koniec riadku sa pocita ako jeden znak, length sa oreze na koniec
+    //  dokumentu. Vrati poziciu za vlozenym textom.
+    Position replace_text(
+        size_t line, size_t column, size_t length, std::string_view text);
+    Position insert_text(size_t line, size_t column, std::string_view text);
+    void delete_text(size_t line, size_t column, size_t length);
+    // To iste pre rozsah od start po end
+    Position replace_range(Position start, Position end, std::string_view text);
+
+private:
+    // Zmaze od start po end a vlozi text
+    Position replace(Position start, Position end, std::string_view text);
+    // Text medzi start a end nahradila uprava, ktorej koniec je teraz
+    //  new_end. Marky vnutri rozsahu skoncia na start, marky za nim sa
+    //  posunu s koncom rozsahu.
+    void shift_marks(Position start, Position end, Position new_end);
+    static void shift_marks(
+        Mark_set& marks, Position start, Position end, Position new_end);
 };
 
-struct Cursor {
-    size_t line, column;
+// Hlava cursora je samotny Mark (v Document::heads), kotva vyberu je v
+//  Document::anchors. Bez vyberu je kotva na hlave. Cursor sa nekopiruje,
+//  dokument drzi smerniky na jeho marky.
+struct Cursor : Mark {
+    Mark anchor;
     Document* document;
-    void set(size_t _line, size_t _column);
-    void set(const Cursor& other);
+    size_t id;
+    // Posledny prikaz klienta, ktory uz je v dokumente
+    uint64_t sequence;
 
-    Cursor();
-    Cursor(Document* document);
-    Cursor(Document* document, const Cursor& other);
-    Cursor(Document* document, size_t _line, size_t _column);
+    Cursor(Document* document, size_t id);
+    ~Cursor();
+    Cursor(const Cursor&) = delete;
+    Cursor& operator=(const Cursor&) = delete;
+
+    // Presunie hlavu, kotva ostane
+    void set(size_t _line, size_t _column);
+    void set_anchor(size_t _line, size_t _column);
+    bool has_selection() const;
+    // Zrusi vyber, kotva pride na hlavu
+    void collapse();
 
     void sync_with_document();
     void home();
@@ -49,53 +135,173 @@ struct Cursor {
     void backspace();
     void break_line();
     void tab();
+    // Vlozeny text ostane pred cursorom, zmazane znaky su za nim
+    void insert_text(std::string_view text);
+    void delete_text(size_t length);
+    void replace_text(size_t length, std::string_view text);
+
+private:
+    // Ak je nieco vybrate, nahradi to textom a vrati true
+    bool replace_selection(std::string_view text);
 };
 
 struct Cursor_image {
     Cursor_image();
-    Cursor_image(size_t line, size_t column, size_t id);
+    Cursor_image(size_t line, size_t column, size_t id, size_t anchor_line,
+        size_t anchor_column, uint64_t sequence);
 
-    bool operator<(const Cursor_image& other);
+    // Podla pozicie hlavy, na rovnakom mieste podla id
+    bool operator<(const Cursor_image& other) const;
 
     size_t line, column, id;
+    size_t anchor_line, anchor_column;
+    uint64_t sequence;
 };
 
 struct Document_image {
     Document_image();
-    // Regular constructor, serializes the object
-    Document_image(const std::vector<std::string>& data,
-        const std::vector<Cursor_image>& cursors);
-    // Constructor from string, deserializes the object
-    Document_image(const std::string& serialized_object);
+    // Regular constructor, only keeps the snapshot, encode() serializes it.
+    //  Cursory musia byt usortene.
+    Document_image(std::shared_ptr<const Storage> lines,
+        std::vector<Cursor_image> cursors, uint64_t version, size_t first,
+        size_t total);
+    // Constructor from payload, the lines keep pointing into it
+    explicit Document_image(std::shared_ptr<const std::string> payload);
+
+    // Pripise binarny tvar na koniec out, riadky ako kusy z uloziska
+    void encode(Protocol::Chunked_message& out) const;
 
     // Je prakticke aby cursory boli usortene
     void sort_cursors();
 
-    std::vector<std::string> data;
+    std::shared_ptr<const Storage> lines;
     std::vector<Cursor_image> cursors;
-    std::string serialized_object;
+    // Verzia dokumentu, na ktoru nadvazuju dalsie delty
+    uint64_t version;
+    // Obraz okna: lines su riadky dokumentu od first, dokument ich ma
+    //  total. Cursory su vsetky, s poziciami v celom dokumente.
+    size_t first, total;
+};
+
+// Lokalna kopia dokumentu alebo jeho okna udrziavana z delt, ktore
+//  posiela server. Uprava mimo okna iba posunie jeho cislovanie, kolko
+//  riadkov ubudlo alebo pribudlo, je vidno z operacie.
+struct Replica {
+    Replica();
+    // Cursory ukazuju na document
+    Replica(const Replica&) = delete;
+    Replica& operator=(const Replica&) = delete;
+
+    void reset(const Document_image& image);
+    // Vrati false, ak delta nenadvazuje alebo uprava zasiahla okno aj
+    //  riadky mimo neho, treba si vypytat novy obraz
+    bool apply(const Delta& delta);
+    Document_image image() const;
+    // Hlava cursora v celom dokumente, aj ked je mimo okna
+    bool head(size_t id, Position& position) const;
+
+    // Riadky okna, prvy je riadok first dokumentu
+    Document document;
+    // Cursory v okne, posuvaju sa rovnako ako cursory na serveri
+    std::map<size_t, Cursor> cursors;
+    // Hlavy cursorov mimo okna
+    std::map<size_t, Position> outside;
+    // Posledny potvrdeny prikaz klienta kazdeho cursora
+    std::map<size_t, uint64_t> sequences;
+    size_t first, total;
+    uint64_t version;
+    // Kym nepride prvy obraz, delty nemaju na co nadviazat
+    bool synced;
+
+private:
+    bool apply_text(const Operation& operation);
+    void move_head(size_t id, Position head);
+    void move_anchor(size_t id, Position anchor);
+};
+
+struct Document_stats {
+    Storage_type type;
+    size_t lines, memory;
+    // Z toho historia undo
+    size_t undo;
 };
 
-namespace Document_handler {
-    static Document document;
-    static std::map<int, Cursor> cursors;
-    static std::mutex mtx;
+class Undo_history;
+
+// Jeden dokument na serveri: obsah, cursory klientov a operacie, ktore
+//  este neodisli v delte. Nie je synchronizovany, server s nim pracuje
+//  vzdy iba z jedneho vlakna (shardu dokumentu).
+class Document_handler {
+public:
+    explicit Document_handler(Storage_type type = Storage_type::Rope);
+    ~Document_handler();
+
+    // Cursory ukazuju na document
+    Document_handler(const Document_handler&) = delete;
+    Document_handler& operator=(const Document_handler&) = delete;
+
+    void open(const std::string& path);
+    void save(const std::string& path) const;
+    // Obsah a cursory z obrazu, rope sa nekopiruje. Undo sa zahodi. Z
+    //  obrazu okna bude mat iba jeho riadky a cursory v nom.
+    void reset(const Document_image& image);
+    // Zopakuje upravy textu z delty, napr. pri obnove z logu
+    void replay(const Delta& delta);
+    // Verzia obsahu nacitaneho zo suboru, dalsie delty na nu nadvazuju
+    void set_version(uint64_t version);
+    uint64_t get_version() const;
+    // Nemenny pohlad na obsah, da sa ulozit na inom vlakne
+    std::shared_ptr<const Storage> snapshot() const;
 
     // API
-    bool process_message(int cursor_id, std::string message);
+    bool process_message(int cursor_id, const std::string& message);
+    // Prikazy klienta cursora az po sequence su spracovane, potvrdenie
+    //  pojde v dalsej delte
+    void acknowledge(int cursor_id, uint64_t sequence);
 
     // Cursor handling
     void add_new_cursor(int cursor_id);
     void remove_cursor(int cursor_id);
     Cursor* get_cursor(int cursor_id);
+    size_t cursors_count() const;
 
     // Serialization
-    Document_image get_document_image();
-    std::string serialize();
+    Document_image get_document_image() const;
+    // Iba count riadkov od first, kopiruju sa
+    Document_image get_document_image(size_t first, size_t count) const;
+    // Cely Image frame pre klienta
+    Protocol::Chunked_message serialize() const;
+    // Operacie od poslednej delty, kazda neprazdna delta zvysi verziu
+    Delta take_delta();
 
     // Dev features
-    void print();
-}
+    // Verzia, cursory a vsetky riadky ako text
+    std::string dump() const;
+    Document_stats stats() const;
+
+private:
+    // Najstarsie kroky undo sa zahadzuju, kym historia vsetkych cursorov
+    //  nie je pod tymto limitom
+    static const size_t UNDO_BUDGET = 4 << 20;
+
+    void trim_undo();
+
+    Document document;
+    std::map<int, Cursor> cursors;
+    // Undo kazdeho cursora, kroky su marky v document
+    std::map<int, std::unique_ptr<Undo_history>> histories;
+    // Upravy prave spracovaneho prikazu
+    std::vector<Edit> edits;
+    // Cursory s novym potvrdenym prikazom od poslednej delty
+    std::set<int> acknowledged;
+    uint64_t undo_sequence;
+    size_t undo_memory;
+    // Verzia poslednej odoslanej delty a operacie, ktore este neodisli
+    uint64_t version;
+    Delta pending;
+    // Po reset z obrazu okna: riadky pred oknom a za nim
+    size_t first, hidden;
+};
 
 }
 
@@ -0,0 +1,249 @@
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <filesystem>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <system_error>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#include "file.h"
+
+namespace Document {
+
+namespace {
+    std::system_error errno_error(const std::string& what)
+    {
+        return std::system_error(errno, std::generic_category(), what);
+    }
+}
+
+Mapped_file::Mapped_file(const std::string& path)
+    : data_(nullptr)
+    , size_(0)
+{
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        throw errno_error("open " + path);
+
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        ::close(fd);
+        throw errno_error("stat " + path);
+    }
+    size_ = st.st_size;
+
+    // prazdny subor sa namapovat neda
+    if (size_ > 0) {
+        void* mapped = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (mapped == MAP_FAILED) {
+            ::close(fd);
+            throw errno_error("mmap " + path);
+        }
+        madvise(mapped, size_, MADV_SEQUENTIAL);
+        data_ = static_cast<const char*>(mapped);
+    }
+    ::close(fd);
+}
+
+Mapped_file::~Mapped_file()
+{
+    if (data_ != nullptr)
+        munmap(const_cast<char*>(data_), size_);
+}
+
+const char* Mapped_file::data() const { return data_; }
+
+size_t Mapped_file::size() const { return size_; }
+
+const size_t Line_index::CHUNK_SIZE = 4 << 20;
+
+Line_index::Line_index(std::shared_ptr<const Mapped_file> file)
+    : file(std::move(file))
+    , chunks(std::max<size_t>(
+          1, (this->file->size() + CHUNK_SIZE - 1) / CHUNK_SIZE))
+    , lines_count_(0)
+{
+    const char* data = this->file->data();
+    size_t size = this->file->size();
+
+    for (size_t i = 0; i < chunks.size(); ++i) {
+        chunks[i].begin = i * CHUNK_SIZE;
+        chunks[i].end = std::min(size, (i + 1) * CHUNK_SIZE);
+    }
+
+    // Riadok patri kusu, v ktorom je newline pred nim, prvy riadok suboru
+    //  patri prvemu kusu.
+    size_t threads_count = std::min<size_t>(
+        chunks.size(), std::max(1u, std::thread::hardware_concurrency()));
+    std::vector<std::thread> threads;
+    for (size_t t = 0; t < threads_count; ++t)
+        threads.emplace_back([this, data, t, threads_count]() {
+            for (size_t i = t; i < chunks.size(); i += threads_count)
+                chunks[i].lines = std::count(data + chunks[i].begin,
+                    data + chunks[i].end, '\n');
+        });
+    for (auto&& thread : threads)
+        thread.join();
+
+    chunks[0].lines += 1;
+    for (auto&& chunk : chunks) {
+        chunk.first_line = lines_count_;
+        lines_count_ += chunk.lines;
+    }
+}
+
+size_t Line_index::lines_count() const { return lines_count_; }
+
+const Line_index::Chunk& Line_index::indexed_chunk(size_t chunk) const
+{
+    const Chunk& c = chunks[chunk];
+    std::call_once(c.indexed, [this, &c, chunk]() {
+        const char* data = file->data();
+        c.starts.reserve(c.lines);
+        if (chunk == 0)
+            c.starts.push_back(0);
+        for (size_t i = c.begin; i < c.end; ++i)
+            if (data[i] == '\n')
+                c.starts.push_back(i + 1 - c.begin);
+    });
+    return c;
+}
+
+std::string_view Line_index::line(size_t line) const
+{
+    // posledny kus, ktory zacina pred hladanym riadkom (alebo na nom)
+    auto it = std::upper_bound(chunks.begin(), chunks.end(), line,
+        [](size_t l, const Chunk& c) { return l < c.first_line; });
+    --it;
+    const Chunk& chunk = indexed_chunk(it - chunks.begin());
+
+    const char* data = file->data();
+    size_t size = file->size();
+    size_t begin = chunk.begin + chunk.starts[line - chunk.first_line];
+    const void* newline = (begin < size)
+        ? std::memchr(data + begin, '\n', size - begin)
+        : nullptr;
+    size_t end = newline ? static_cast<const char*>(newline) - data : size;
+    return std::string_view(data + begin, end - begin);
+}
+
+const size_t Atomic_file_writer::BUFFER_SIZE = 1 << 16;
+
+namespace {
+    // Poradie docasneho suboru v tomto procese
+    std::atomic<uint64_t> temporary_files(0);
+
+    const std::string_view TEMPORARY_INFIX(".tmp.");
+}
+
+Atomic_file_writer::Atomic_file_writer(const std::string& path)
+    : path(path)
+    , temporary_path(path + std::string(TEMPORARY_INFIX)
+          + std::to_string(getpid()) + "." + std::to_string(temporary_files++))
+    , buffer(BUFFER_SIZE)
+    , used(0)
+{
+    fd = ::open(temporary_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        throw errno_error("open " + temporary_path);
+}
+
+Atomic_file_writer::~Atomic_file_writer()
+{
+    // necommitnuty zapis zahodime
+    if (fd >= 0) {
+        ::close(fd);
+        ::unlink(temporary_path.c_str());
+    }
+}
+
+void Atomic_file_writer::write(std::string_view data)
+{
+    if (used + data.size() > buffer.size()) {
+        flush();
+        // velke kusy ideme zapisat priamo, bez kopirovania do bufferu
+        if (data.size() >= buffer.size()) {
+            while (!data.empty()) {
+                ssize_t written = ::write(fd, data.data(), data.size());
+                if (written < 0 and errno == EINTR)
+                    continue;
+                check_written(written);
+                data.remove_prefix(written);
+            }
+            return;
+        }
+    }
+    if (!data.empty())
+        std::memcpy(buffer.data() + used, data.data(), data.size());
+    used += data.size();
+}
+
+void Atomic_file_writer::flush()
+{
+    size_t done = 0;
+    while (done < used) {
+        ssize_t written = ::write(fd, buffer.data() + done, used - done);
+        if (written < 0 and errno == EINTR)
+            continue;
+        check_written(written);
+        done += written;
+    }
+    used = 0;
+}
+
+void Atomic_file_writer::check_written(ssize_t written) const
+{
+    if (written < 0)
+        throw errno_error("write " + temporary_path);
+    // nic nezapisany write by sa opakoval donekonecna
+    if (written == 0)
+        throw std::system_error(std::make_error_code(std::errc::io_error),
+            "write " + temporary_path);
+}
+
+void Atomic_file_writer::commit()
+{
+    flush();
+    if (fsync(fd) < 0)
+        throw errno_error("fsync " + temporary_path);
+    ::close(fd);
+    fd = -1;
+
+    if (rename(temporary_path.c_str(), path.c_str()) < 0)
+        throw errno_error("rename " + temporary_path);
+
+    // aby prezil aj samotny rename
+    sync_directory(path);
+}
+
+bool is_temporary_file_name(std::string_view name)
+{
+    return name.find(TEMPORARY_INFIX) != std::string_view::npos;
+}
+
+void remove_temporary_files(const std::string& directory)
+{
+    for (auto&& entry : std::filesystem::directory_iterator(directory))
+        if (is_temporary_file_name(entry.path().filename().string()))
+            std::filesystem::remove(entry.path());
+}
+
+void sync_directory(const std::string& path)
+{
+    size_t slash = path.rfind('/');
+    std::string directory
+        = (slash == std::string::npos) ? "." : path.substr(0, slash + 1);
+    int directory_fd = ::open(directory.c_str(), O_RDONLY | O_DIRECTORY);
+    if (directory_fd >= 0) {
+        fsync(directory_fd);
+        ::close(directory_fd);
+    }
+}
+
+}
@@ -0,0 +1,100 @@
+#ifndef M_FILE
+#define M_FILE
+
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <sys/types.h>
+#include <vector>
+
+#include "line.h"
+
+namespace Document {
+
+// Subor namapovany do pamate iba na citanie
+class Mapped_file {
+public:
+    explicit Mapped_file(const std::string& path);
+    ~Mapped_file();
+
+    Mapped_file(const Mapped_file&) = delete;
+    Mapped_file& operator=(const Mapped_file&) = delete;
+
+    const char* data() const;
+    size_t size() const;
+
+private:
+    const char* data_;
+    size_t size_;
+};
+
+// Index riadkov namapovaneho suboru. Pri vytvoreni sa iba paralelne spocitaju
+//  newline-y po kusoch suboru, offsety riadkov v kuse sa postavia az pri
+//  prvom pristupe do neho.
+class Line_index : public Line_source {
+public:
+    explicit Line_index(std::shared_ptr<const Mapped_file> file);
+
+    size_t lines_count() const override;
+    std::string_view line(size_t line) const override;
+
+private:
+    struct Chunk {
+        size_t begin, end;
+        size_t first_line, lines;
+        mutable std::once_flag indexed;
+        // Zaciatky riadkov relativne k begin
+        mutable std::vector<uint32_t> starts;
+    };
+
+    const Chunk& indexed_chunk(size_t chunk) const;
+
+    std::shared_ptr<const Mapped_file> file;
+    std::vector<Chunk> chunks;
+    size_t lines_count_;
+
+    static const size_t CHUNK_SIZE;
+};
+
+// Zapisuje do docasneho suboru vedla ciela, commit() ho fsync-ne a
+//  premenuje na cielovy subor. Ak sa commit nezavola, ciel ostane netknuty.
+//  Docasny subor ma meno path.tmp.<pid>.<poradie>, subezne zapisy toho
+//  isteho ciela si ho tak neprepisuju.
+class Atomic_file_writer {
+public:
+    explicit Atomic_file_writer(const std::string& path);
+    ~Atomic_file_writer();
+
+    Atomic_file_writer(const Atomic_file_writer&) = delete;
+    Atomic_file_writer& operator=(const Atomic_file_writer&) = delete;
+
+    void write(std::string_view data);
+    void commit();
+
+private:
+    void flush();
+    // Vysledok ::write okrem EINTR, chybu aj nulu zmeni na vynimku
+    void check_written(ssize_t written) const;
+
+    std::string path, temporary_path;
+    int fd;
+    std::vector<char> buffer;
+    size_t used;
+
+    static const size_t BUFFER_SIZE;
+};
+
+// Meno docasneho suboru Atomic_file_writer-a
+bool is_temporary_file_name(std::string_view name);
+// Zmaze docasne subory, ktore v adresari nechal pad procesu. Volat iba ked
+//  do adresara nikto nezapisuje.
+void remove_temporary_files(const std::string& directory);
+
+// fsync adresara so suborom path, aby prezilo jeho vytvorenie a rename
+void sync_directory(const std::string& path);
+
+}
+
+#endif
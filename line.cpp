@@ -0,0 +1,154 @@
+#include <algorithm>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "line.h"
+
+namespace Document {
+
+Line_view::Line_view(std::string_view head, std::string_view tail)
+    : head(head)
+    , tail(tail)
+{
+}
+
+size_t Line_view::length() const { return head.size() + tail.size(); }
+
+char Line_view::operator[](size_t column) const
+{
+    return (column < head.size()) ? head[column] : tail[column - head.size()];
+}
+
+std::string Line_view::str() const
+{
+    std::string result;
+    append_to(result);
+    return result;
+}
+
+void Line_view::append_to(std::string& out) const
+{
+    out.reserve(out.size() + length());
+    out.append(head.data(), head.size());
+    out.append(tail.data(), tail.size());
+}
+
+Line::Line()
+    : gap_begin(0)
+    , gap_end(0)
+{
+}
+
+Line::Line(std::string_view text)
+    : buffer(text.begin(), text.end())
+    , gap_begin(text.size())
+    , gap_end(text.size())
+{
+}
+
+Line::Line(const Line_view& text)
+    : gap_begin(text.length())
+    , gap_end(text.length())
+{
+    buffer.reserve(text.length());
+    buffer.insert(buffer.end(), text.head.begin(), text.head.end());
+    buffer.insert(buffer.end(), text.tail.begin(), text.tail.end());
+}
+
+size_t Line::length() const { return buffer.size() - gap_length(); }
+
+char Line::operator[](size_t column) const
+{
+    return (column < gap_begin) ? buffer[column]
+                                : buffer[column + gap_length()];
+}
+
+size_t Line::capacity() const { return buffer.capacity(); }
+
+size_t Line::gap_length() const { return gap_end - gap_begin; }
+
+void Line::move_gap(size_t column)
+{
+    // presuvame iba znaky medzi starou a novou poziciou medzery
+    if (column < gap_begin) {
+        size_t count = gap_begin - column;
+        std::memmove(buffer.data() + gap_end - count, buffer.data() + column,
+            count);
+        gap_begin -= count;
+        gap_end -= count;
+    } else if (column > gap_begin) {
+        size_t count = column - gap_begin;
+        std::memmove(buffer.data() + gap_begin, buffer.data() + gap_end,
+            count);
+        gap_begin += count;
+        gap_end += count;
+    }
+}
+
+void Line::grow(size_t min_gap)
+{
+    size_t tail_length = buffer.size() - gap_end;
+    size_t new_size = std::max(buffer.size() * 2, length() + min_gap);
+    new_size = std::max<size_t>(new_size, 16);
+
+    buffer.resize(new_size);
+    // tail presunieme na koniec noveho bufferu
+    std::memmove(buffer.data() + new_size - tail_length,
+        buffer.data() + gap_end, tail_length);
+    gap_end = new_size - tail_length;
+}
+
+void Line::insert(size_t column, char ch)
+{
+    if (gap_length() == 0)
+        grow(1);
+    move_gap(column);
+    buffer[gap_begin++] = ch;
+}
+
+void Line::erase(size_t column)
+{
+    move_gap(column);
+    ++gap_end;
+}
+
+void Line::append(const Line_view& text)
+{
+    if (gap_length() < text.length())
+        grow(text.length());
+    move_gap(length());
+    for (std::string_view part : { text.head, text.tail }) {
+        if (!part.empty())
+            std::memcpy(buffer.data() + gap_begin, part.data(), part.size());
+        gap_begin += part.size();
+    }
+}
+
+Line Line::split(size_t column)
+{
+    move_gap(column);
+    Line rest(std::string_view(
+        buffer.data() + gap_end, buffer.size() - gap_end));
+    // tail zahodime, z medzery sa stane koniec bufferu
+    gap_end = buffer.size();
+    return rest;
+}
+
+Line_view Line::view() const
+{
+    return Line_view(std::string_view(buffer.data(), gap_begin),
+        std::string_view(
+            buffer.data() + gap_end, buffer.size() - gap_end));
+}
+
+std::string_view Line::contiguous()
+{
+    move_gap(length());
+    return std::string_view(buffer.data(), gap_begin);
+}
+
+std::string Line::str() const { return view().str(); }
+
+}
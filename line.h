@@ -0,0 +1,68 @@
+#ifndef M_LINE
+#define M_LINE
+
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace Document {
+
+// Obsah riadku ako dva suvisle kusy (pred a za medzerou gap bufferu). Na
+//  serializaciu netreba medzeru presuvat, staci zapisat oba kusy za sebou.
+struct Line_view {
+    Line_view() = default;
+    Line_view(std::string_view head, std::string_view tail = {});
+
+    size_t length() const;
+    char operator[](size_t column) const;
+    std::string str() const;
+    void append_to(std::string& out) const;
+
+    std::string_view head, tail;
+};
+
+// Nemenny zdroj riadkov (namapovany subor, prijata sprava). Ulozisko si ho
+//  moze ponechat a riadky z neho citat bez kopirovania.
+class Line_source {
+public:
+    virtual ~Line_source() = default;
+
+    virtual size_t lines_count() const = 0;
+    virtual std::string_view line(size_t line) const = 0;
+};
+
+// Riadok ako gap buffer. Medzera zostava na stlpci posledneho editu, takze
+//  serie write/backspace na jednom mieste stoja amortizovane O(1).
+class Line {
+public:
+    Line();
+    explicit Line(std::string_view text);
+    explicit Line(const Line_view& text);
+
+    size_t length() const;
+    char operator[](size_t column) const;
+    size_t capacity() const;
+
+    void insert(size_t column, char ch);
+    void erase(size_t column);
+    void append(const Line_view& text);
+    // Odreze vsetko od column dalej a vrati to ako novy riadok
+    Line split(size_t column);
+
+    Line_view view() const;
+    // Suvisly pohlad, presunie medzeru na koniec riadku
+    std::string_view contiguous();
+    std::string str() const;
+
+private:
+    size_t gap_length() const;
+    void move_gap(size_t column);
+    void grow(size_t min_gap);
+
+    std::vector<char> buffer;
+    size_t gap_begin, gap_end;
+};
+
+}
+
+#endif
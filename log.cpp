@@ -0,0 +1,166 @@
+#include <chrono>
+#include <cstdio>
+#include <ctime>
+#include <string>
+#include <thread>
+
+#include "log.h"
+#include "mpsc_ring.h"
+
+namespace Document {
+
+namespace {
+    struct Record {
+        Log::Level level;
+        std::chrono::system_clock::time_point time;
+        std::string message;
+    };
+
+    const size_t RING_CAPACITY = 1 << 13;
+    // Ked je ring prazdny, vlakno logu sa tolko vyspi
+    const std::chrono::milliseconds IDLE_SLEEP(5);
+
+    std::atomic<Log::Level> current_level(Log::Level::Info);
+    Mpsc_ring<Record> ring(RING_CAPACITY);
+    // Zaznamy zahodene pre plny ring
+    std::atomic<uint64_t> overflowed(0);
+    std::atomic<bool> running(false);
+    std::thread writer;
+
+    void print(const Record& record)
+    {
+        std::time_t seconds = std::chrono::system_clock::to_time_t(record.time);
+        auto millis = std::chrono::duration_cast<std::chrono::milliseconds>(
+                          record.time.time_since_epoch())
+                          .count()
+            % 1000;
+        std::tm local;
+        localtime_r(&seconds, &local);
+        char stamp[16];
+        std::strftime(stamp, sizeof(stamp), "%H:%M:%S", &local);
+
+        FILE* out = record.level >= Log::Level::Warning ? stderr : stdout;
+        std::fprintf(out, "%s.%03d %-7s %s\n", stamp, int(millis),
+            Log::level_name(record.level), record.message.c_str());
+    }
+
+    // Vrati false, ak v ringu nic nebolo
+    bool drain()
+    {
+        Record record;
+        bool any = false;
+        while (ring.pop(record)) {
+            print(record);
+            any = true;
+        }
+        uint64_t lost = overflowed.exchange(0);
+        if (lost != 0) {
+            print(Record { Log::Level::Warning,
+                std::chrono::system_clock::now(),
+                std::to_string(lost) + " log records lost, ring full" });
+            any = true;
+        }
+        if (any) {
+            std::fflush(stdout);
+            std::fflush(stderr);
+        }
+        return any;
+    }
+
+    void run()
+    {
+        while (running)
+            if (!drain())
+                std::this_thread::sleep_for(IDLE_SLEEP);
+        drain();
+    }
+}
+
+bool Log::parse_level(const std::string& name, Level& level)
+{
+    for (int i = int(Level::Dump); i <= int(Level::Off); ++i)
+        if (name == level_name(Level(i))) {
+            level = Level(i);
+            return true;
+        }
+    return false;
+}
+
+const char* Log::level_name(Level level)
+{
+    switch (level) {
+    case Level::Dump:
+        return "dump";
+    case Level::Debug:
+        return "debug";
+    case Level::Info:
+        return "info";
+    case Level::Warning:
+        return "warning";
+    case Level::Error:
+        return "error";
+    case Level::Off:
+        return "off";
+    }
+    return "unknown";
+}
+
+void Log::set_level(Level level) { current_level = level; }
+
+bool Log::enabled(Level level)
+{
+    return level >= current_level.load(std::memory_order_relaxed)
+        and level != Level::Off;
+}
+
+void Log::start()
+{
+    if (running.exchange(true))
+        return;
+    writer = std::thread(run);
+}
+
+void Log::stop()
+{
+    if (!running.exchange(false))
+        return;
+    writer.join();
+}
+
+void Log::write(Level level, std::string message, uint64_t suppressed)
+{
+    if (suppressed != 0)
+        message += " (" + std::to_string(suppressed) + " similar suppressed)";
+    Record record { level, std::chrono::system_clock::now(),
+        std::move(message) };
+    if (!ring.push(record))
+        ++overflowed;
+}
+
+Log::Rate_limit::Rate_limit()
+    : second(0)
+    , count(0)
+    , dropped(0)
+{
+}
+
+bool Log::Rate_limit::allow(uint64_t& suppressed)
+{
+    int64_t now = std::chrono::duration_cast<std::chrono::seconds>(
+        std::chrono::steady_clock::now().time_since_epoch())
+                      .count();
+    int64_t last = second.load(std::memory_order_relaxed);
+    suppressed = 0;
+    // novu sekundu zacne iba jedno vlakno, ostatne uz pocitaju v nej
+    if (last != now and second.compare_exchange_strong(last, now)) {
+        count = 0;
+        suppressed = dropped.exchange(0);
+    }
+    if (++count <= LIMIT)
+        return true;
+    ++dropped;
+    suppressed = 0;
+    return false;
+}
+
+}
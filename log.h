@@ -0,0 +1,84 @@
+#ifndef M_LOG
+#define M_LOG
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+// Urovne pod touto sa vobec neprekladaju, napr. make LOG_LEVEL=2 vyhodi
+//  dumpy dokumentu aj debug vypisy
+#ifndef LOG_COMPILED_LEVEL
+#define LOG_COMPILED_LEVEL 0
+#endif
+
+namespace Document {
+
+// Asynchronny log. Volajuce vlakno iba zaradi zaznam do ringu bez zamkov,
+//  formatovanie casu a zapis na vystup robi vlakno logu. Ked je ring plny,
+//  zaznam sa zahodi, zapis nikdy neblokuje.
+namespace Log {
+    enum class Level : uint8_t {
+        Dump = 0, // cely obsah dokumentu po kazdom prikaze
+        Debug = 1,
+        Info = 2,
+        Warning = 3,
+        Error = 4,
+        Off = 5,
+    };
+
+    // Zaznamy nizsich urovni kompilator vyhodi
+    constexpr bool compiled(Level level)
+    {
+        return level >= Level(LOG_COMPILED_LEVEL);
+    }
+
+    bool parse_level(const std::string& name, Level& level);
+    const char* level_name(Level level);
+
+    void set_level(Level level);
+    bool enabled(Level level);
+
+    // Spusti a zastavi vlakno logu, stop vypise vsetko, co este je v ringu
+    void start();
+    void stop();
+
+    // suppressed je pocet zaznamov z toho isteho miesta, ktore zahodil
+    //  Rate_limit, pripise sa k sprave
+    void write(Level level, std::string message, uint64_t suppressed = 0);
+
+    // Obmedzenie pre jedno miesto v kode: najviac LIMIT zaznamov za
+    //  sekundu, o zahodenych da vediet dalsi povoleny zaznam
+    class Rate_limit {
+    public:
+        Rate_limit();
+
+        // Vrati false, ak sa ma zaznam zahodit. Pri prvom zazname v novej
+        //  sekunde vrati v suppressed pocet zahodenych v predoslych.
+        bool allow(uint64_t& suppressed);
+
+    private:
+        std::atomic<int64_t> second;
+        std::atomic<uint32_t> count;
+        std::atomic<uint64_t> dropped;
+
+        static const uint32_t LIMIT = 100;
+    };
+}
+
+}
+
+// Sprava sa vyhodnoti iba ak je uroven prelozena, zapnuta a miesto v kode
+//  este neprekrocilo svoj limit
+#define LOG(level, message)                                                   \
+    do {                                                                      \
+        if (Document::Log::compiled(Document::Log::Level::level)              \
+            and Document::Log::enabled(Document::Log::Level::level)) {        \
+            static Document::Log::Rate_limit log_limit_;                      \
+            uint64_t log_suppressed_;                                         \
+            if (log_limit_.allow(log_suppressed_))                            \
+                Document::Log::write(Document::Log::Level::level, (message),  \
+                    log_suppressed_);                                         \
+        }                                                                     \
+    } while (false)
+
+#endif
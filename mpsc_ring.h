@@ -0,0 +1,101 @@
+#ifndef M_MPSC_RING
+#define M_MPSC_RING
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+namespace Document {
+
+// Ohraniceny ring bez zamkov, zapisuje lubovolny pocet vlakien, cita jedno.
+//  Kazdy slot ma poradove cislo: slot je volny pre zapis na poziciu pos,
+//  ked sequence == pos, a pripraveny na citanie, ked sequence == pos + 1.
+//  Zapisovatelia si poziciu rezervuju CAS-om na tail, citatel sa posuva
+//  bez atomickych operacii na head.
+template <typename T>
+class Mpsc_ring {
+public:
+    // Kapacita sa zaokruhli hore na mocninu dvoch
+    explicit Mpsc_ring(size_t capacity)
+        : capacity(round_up(capacity))
+        , slots(new Slot[this->capacity])
+        , tail(0)
+        , head(0)
+    {
+        for (size_t i = 0; i < this->capacity; ++i)
+            slots[i].sequence.store(i, std::memory_order_relaxed);
+    }
+
+    Mpsc_ring(const Mpsc_ring&) = delete;
+    Mpsc_ring& operator=(const Mpsc_ring&) = delete;
+
+    // Z lubovolneho vlakna. Ak je ring plny, vrati false a value necha tak.
+    bool push(T& value)
+    {
+        size_t position = tail.load(std::memory_order_relaxed);
+        Slot* slot;
+        for (;;) {
+            slot = &slots[position & (capacity - 1)];
+            size_t sequence = slot->sequence.load(std::memory_order_acquire);
+            intptr_t difference = intptr_t(sequence) - intptr_t(position);
+            if (difference == 0) {
+                if (tail.compare_exchange_weak(
+                        position, position + 1, std::memory_order_relaxed))
+                    break;
+            } else if (difference < 0)
+                return false;
+            else
+                position = tail.load(std::memory_order_relaxed);
+        }
+        slot->value = std::move(value);
+        slot->sequence.store(position + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Iba citatel. Zapis, ktory si miesto rezervoval, ale este ho
+    //  nedokoncil, sa tvari ako prazdny ring.
+    bool pop(T& value)
+    {
+        Slot& slot = slots[head & (capacity - 1)];
+        if (slot.sequence.load(std::memory_order_acquire) != head + 1)
+            return false;
+        value = std::move(slot.value);
+        slot.value = T();
+        slot.sequence.store(head + capacity, std::memory_order_release);
+        ++head;
+        return true;
+    }
+
+    // Iba citatel
+    bool empty() const
+    {
+        return slots[head & (capacity - 1)].sequence.load(
+                   std::memory_order_acquire)
+            != head + 1;
+    }
+
+private:
+    struct Slot {
+        std::atomic<size_t> sequence;
+        T value;
+    };
+
+    static size_t round_up(size_t capacity)
+    {
+        size_t result = 1;
+        while (result < capacity)
+            result <<= 1;
+        return result;
+    }
+
+    const size_t capacity;
+    std::unique_ptr<Slot[]> slots;
+    // Zapisovatelia a citatel na roznych cache linkach
+    alignas(64) std::atomic<size_t> tail;
+    alignas(64) size_t head;
+};
+
+}
+
+#endif
@@ -0,0 +1,475 @@
+#include <cctype>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "protocol.h"
+
+namespace Document {
+
+namespace {
+    Operation make_operation(Operation::Type type, size_t line, size_t column)
+    {
+        Operation operation;
+        operation.type = type;
+        operation.line = line;
+        operation.column = column;
+        operation.cursor_id = 0;
+        operation.length = operation.end_line = operation.end_column = 0;
+        operation.sequence = 0;
+        return operation;
+    }
+
+    // Dlzka frame-u v hlavicke, little endian
+    void write_length(char* header, uint32_t length)
+    {
+        for (size_t i = 0; i < Protocol::LENGTH_SIZE; ++i)
+            header[i] = char((length >> (8 * i)) & 0xff);
+    }
+}
+
+Operation Operation::insert_char(size_t line, size_t column, char ch)
+{
+    Operation operation = make_operation(Type::Insert_char, line, column);
+    operation.text = std::string(1, ch);
+    return operation;
+}
+
+Operation Operation::delete_char(size_t line, size_t column)
+{
+    return make_operation(Type::Delete_char, line, column);
+}
+
+Operation Operation::break_line(size_t line, size_t column)
+{
+    return make_operation(Type::Break_line, line, column);
+}
+
+Operation Operation::insert_line(size_t line, const std::string& content)
+{
+    Operation operation = make_operation(Type::Insert_line, line, 0);
+    operation.text = content;
+    return operation;
+}
+
+Operation Operation::delete_line(size_t line)
+{
+    return make_operation(Type::Delete_line, line, 0);
+}
+
+Operation Operation::join_lines(size_t line)
+{
+    return make_operation(Type::Join_lines, line, 0);
+}
+
+Operation Operation::move_cursor(size_t id, size_t line, size_t column)
+{
+    Operation operation = make_operation(Type::Move_cursor, line, column);
+    operation.cursor_id = id;
+    return operation;
+}
+
+Operation Operation::move_anchor(size_t id, size_t line, size_t column)
+{
+    Operation operation = make_operation(Type::Move_anchor, line, column);
+    operation.cursor_id = id;
+    return operation;
+}
+
+Operation Operation::remove_cursor(size_t id)
+{
+    Operation operation = make_operation(Type::Remove_cursor, 0, 0);
+    operation.cursor_id = id;
+    return operation;
+}
+
+Operation Operation::acknowledge(size_t id, uint64_t sequence)
+{
+    Operation operation = make_operation(Type::Acknowledge, 0, 0);
+    operation.cursor_id = id;
+    operation.sequence = sequence;
+    return operation;
+}
+
+Operation Operation::replace_text(
+    size_t line, size_t column, size_t length, std::string text)
+{
+    Operation operation = make_operation(Type::Replace_text, line, column);
+    operation.length = length;
+    operation.text = std::move(text);
+    return operation;
+}
+
+Operation Operation::replace_range(size_t line, size_t column,
+    size_t end_line, size_t end_column, std::string text)
+{
+    Operation operation = make_operation(Type::Replace_range, line, column);
+    operation.end_line = end_line;
+    operation.end_column = end_column;
+    operation.text = std::move(text);
+    return operation;
+}
+
+bool Operation::edits_text() const
+{
+    switch (type) {
+    case Type::Move_cursor:
+    case Type::Move_anchor:
+    case Type::Remove_cursor:
+    case Type::Acknowledge:
+        return false;
+    default:
+        return true;
+    }
+}
+
+Delta::Delta()
+    : version(0)
+{
+}
+
+// Constructor from payload, deserializes the object
+Delta::Delta(const char* begin, const char* end)
+{
+    Protocol::Reader reader(begin, end);
+    version = reader.varint();
+    operations.resize(reader.varint());
+    for (auto&& operation : operations) {
+        operation.type = Operation::Type(reader.byte());
+        operation.line = operation.column = operation.cursor_id = 0;
+        operation.length = operation.end_line = operation.end_column = 0;
+        operation.sequence = 0;
+
+        // kazdy typ nesie iba polia, ktore potrebuje
+        switch (operation.type) {
+        case Operation::Type::Insert_char:
+            operation.line = reader.varint();
+            operation.column = reader.varint();
+            operation.text = std::string(reader.bytes(1));
+            break;
+        case Operation::Type::Delete_char:
+        case Operation::Type::Break_line:
+            operation.line = reader.varint();
+            operation.column = reader.varint();
+            break;
+        case Operation::Type::Insert_line:
+            operation.line = reader.varint();
+            operation.text = std::string(reader.text());
+            break;
+        case Operation::Type::Delete_line:
+        case Operation::Type::Join_lines:
+            operation.line = reader.varint();
+            break;
+        case Operation::Type::Move_cursor:
+        case Operation::Type::Move_anchor:
+            operation.cursor_id = reader.varint();
+            operation.line = reader.varint();
+            operation.column = reader.varint();
+            break;
+        case Operation::Type::Remove_cursor:
+            operation.cursor_id = reader.varint();
+            break;
+        case Operation::Type::Acknowledge:
+            operation.cursor_id = reader.varint();
+            operation.sequence = reader.varint();
+            break;
+        case Operation::Type::Replace_text:
+            operation.line = reader.varint();
+            operation.column = reader.varint();
+            operation.length = reader.varint();
+            operation.text = std::string(reader.text());
+            break;
+        case Operation::Type::Replace_range:
+            operation.line = reader.varint();
+            operation.column = reader.varint();
+            operation.end_line = reader.varint();
+            operation.end_column = reader.varint();
+            operation.text = std::string(reader.text());
+            break;
+        default:
+            throw Protocol::Protocol_error("Unknown operation");
+        }
+    }
+}
+
+void Delta::encode(std::string& out) const
+{
+    using Protocol::put_varint;
+
+    put_varint(out, version);
+    put_varint(out, operations.size());
+    for (auto&& operation : operations) {
+        out += char(operation.type);
+        switch (operation.type) {
+        case Operation::Type::Insert_char:
+            put_varint(out, operation.line);
+            put_varint(out, operation.column);
+            out += operation.text[0];
+            break;
+        case Operation::Type::Delete_char:
+        case Operation::Type::Break_line:
+            put_varint(out, operation.line);
+            put_varint(out, operation.column);
+            break;
+        case Operation::Type::Insert_line:
+            put_varint(out, operation.line);
+            Protocol::put_bytes(out, operation.text);
+            break;
+        case Operation::Type::Delete_line:
+        case Operation::Type::Join_lines:
+            put_varint(out, operation.line);
+            break;
+        case Operation::Type::Move_cursor:
+        case Operation::Type::Move_anchor:
+            put_varint(out, operation.cursor_id);
+            put_varint(out, operation.line);
+            put_varint(out, operation.column);
+            break;
+        case Operation::Type::Remove_cursor:
+            put_varint(out, operation.cursor_id);
+            break;
+        case Operation::Type::Acknowledge:
+            put_varint(out, operation.cursor_id);
+            put_varint(out, operation.sequence);
+            break;
+        case Operation::Type::Replace_text:
+            put_varint(out, operation.line);
+            put_varint(out, operation.column);
+            put_varint(out, operation.length);
+            Protocol::put_bytes(out, operation.text);
+            break;
+        case Operation::Type::Replace_range:
+            put_varint(out, operation.line);
+            put_varint(out, operation.column);
+            put_varint(out, operation.end_line);
+            put_varint(out, operation.end_column);
+            Protocol::put_bytes(out, operation.text);
+            break;
+        }
+    }
+}
+
+void Protocol::put_varint(std::string& out, uint64_t value)
+{
+    // 7 bitov na bajt, najvyssi bit znaci, ze pokracuje dalsi bajt
+    while (value >= 0x80) {
+        out += char((value & 0x7f) | 0x80);
+        value >>= 7;
+    }
+    out += char(value);
+}
+
+void Protocol::put_bytes(std::string& out, std::string_view bytes)
+{
+    put_varint(out, bytes.size());
+    out.append(bytes.data(), bytes.size());
+}
+
+size_t Protocol::begin_frame(std::string& out, Message_type type)
+{
+    size_t frame_begin = out.size();
+    out.append(LENGTH_SIZE, '\0');
+    out += char(type);
+    return frame_begin;
+}
+
+void Protocol::end_frame(std::string& out, size_t frame_begin)
+{
+    write_length(&out[frame_begin], out.size() - frame_begin - LENGTH_SIZE);
+}
+
+std::string Protocol::frame(Message_type type, std::string_view payload)
+{
+    std::string out;
+    out.reserve(HEADER_SIZE + payload.size());
+    size_t frame_begin = begin_frame(out, type);
+    out.append(payload.data(), payload.size());
+    end_frame(out, frame_begin);
+    return out;
+}
+
+Protocol::Chunked_message::Chunked_message()
+    : size_(0)
+{
+}
+
+Protocol::Chunked_message::Chunked_message(std::string bytes)
+    : size_(0)
+{
+    append(std::move(bytes));
+}
+
+void Protocol::Chunked_message::append(std::string bytes)
+{
+    append(std::make_shared<const std::string>(std::move(bytes)));
+}
+
+void Protocol::Chunked_message::append(std::shared_ptr<const std::string> chunk)
+{
+    if (chunk->empty())
+        return;
+    size_ += chunk->size();
+    chunks_.push_back(std::move(chunk));
+}
+
+void Protocol::Chunked_message::append(const Chunked_message& other)
+{
+    chunks_.insert(chunks_.end(), other.chunks_.begin(), other.chunks_.end());
+    size_ += other.size_;
+}
+
+size_t Protocol::Chunked_message::size() const { return size_; }
+
+const std::vector<std::shared_ptr<const std::string>>&
+Protocol::Chunked_message::chunks() const
+{
+    return chunks_;
+}
+
+Protocol::Chunked_message Protocol::frame(
+    Message_type type, const Chunked_message& payload)
+{
+    std::string header;
+    begin_frame(header, type);
+    write_length(&header[0], payload.size() + 1);
+
+    Chunked_message result(std::move(header));
+    result.append(payload);
+    return result;
+}
+
+bool Protocol::valid_document_name(std::string_view name)
+{
+    if (name.empty() or name.size() > MAX_DOCUMENT_NAME or name[0] == '.')
+        return false;
+    for (char ch : name)
+        if (!std::isalnum(static_cast<unsigned char>(ch)) and ch != '_'
+            and ch != '.' and ch != '-')
+            return false;
+    return true;
+}
+
+uint32_t Protocol::frame_length(const char* header)
+{
+    uint32_t length = 0;
+    for (size_t i = 0; i < LENGTH_SIZE; ++i)
+        length |= uint32_t(uint8_t(header[i])) << (8 * i);
+    return length;
+}
+
+Protocol::Frame_decoder::Frame_decoder()
+    : buffer(BUFFER_SIZE, '\0')
+    , begin(0)
+    , end(0)
+    , large_filled(0)
+    , large_type(Message_type::Error)
+{
+}
+
+char* Protocol::Frame_decoder::prepare(size_t& size)
+{
+    if (large) {
+        size = large->size() - large_filled;
+        return &(*large)[large_filled];
+    }
+    // nedokonceny frame sa presunie na zaciatok, potom sa do bufferu
+    //  urcite zmesti cely
+    if (begin > 0) {
+        std::memmove(&buffer[0], &buffer[begin], end - begin);
+        end -= begin;
+        begin = 0;
+    }
+    size = buffer.size() - end;
+    return &buffer[end];
+}
+
+void Protocol::Frame_decoder::commit(size_t size)
+{
+    if (large)
+        large_filled += size;
+    else
+        end += size;
+}
+
+bool Protocol::Frame_decoder::next(
+    Message_type& type, std::shared_ptr<const std::string>& payload)
+{
+    if (large) {
+        if (large_filled < large->size())
+            return false;
+        type = large_type;
+        payload = std::move(large);
+        large = nullptr;
+        return true;
+    }
+
+    size_t available = end - begin;
+    if (available < HEADER_SIZE)
+        return false;
+    uint32_t length = frame_length(&buffer[begin]);
+    if (length == 0)
+        throw Protocol_error("Invalid frame length");
+    Message_type frame_type = Message_type(buffer[begin + LENGTH_SIZE]);
+    size_t size = length - 1;
+    const char* data = &buffer[begin + HEADER_SIZE];
+
+    if (available - HEADER_SIZE >= size) {
+        type = frame_type;
+        payload = std::make_shared<const std::string>(data, size);
+        begin += HEADER_SIZE + size;
+        return true;
+    }
+    if (HEADER_SIZE + size > buffer.size()) {
+        // zvysok payloadu pojde rovno sem, buffer sa uvolni
+        large = std::make_shared<std::string>(size, '\0');
+        large_filled = available - HEADER_SIZE;
+        std::memcpy(&(*large)[0], data, large_filled);
+        large_type = frame_type;
+        begin = end = 0;
+    }
+    return false;
+}
+
+Protocol::Reader::Reader(const char* begin, const char* end)
+    : position(begin)
+    , end(end)
+{
+}
+
+uint8_t Protocol::Reader::byte()
+{
+    if (position == end)
+        throw Protocol_error("Truncated payload");
+    return uint8_t(*position++);
+}
+
+uint64_t Protocol::Reader::varint()
+{
+    uint64_t value = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        uint8_t b = byte();
+        value |= uint64_t(b & 0x7f) << shift;
+        if (!(b & 0x80))
+            return value;
+    }
+    throw Protocol_error("Varint too long");
+}
+
+std::string_view Protocol::Reader::bytes(size_t length)
+{
+    if (size_t(end - position) < length)
+        throw Protocol_error("Truncated payload");
+    std::string_view result(position, length);
+    position += length;
+    return result;
+}
+
+std::string_view Protocol::Reader::text() { return bytes(varint()); }
+
+std::string_view Protocol::Reader::rest() { return bytes(end - position); }
+
+bool Protocol::Reader::done() const { return position == end; }
+
+}
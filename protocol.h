@@ -0,0 +1,198 @@
+#ifndef M_PROTOCOL
+#define M_PROTOCOL
+
+#include <cstdint>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace Document {
+
+// Jedna zmena dokumentu alebo cursora. Replika, ktora aplikuje rovnake
+//  operacie v rovnakom poradi, skonci v rovnakom stave ako server.
+struct Operation {
+    enum class Type : uint8_t {
+        Insert_char = 1,
+        Delete_char = 2,
+        Break_line = 3,
+        Insert_line = 4,
+        Delete_line = 5,
+        Move_cursor = 6,
+        Remove_cursor = 7,
+        Replace_text = 8,
+        Move_anchor = 9,
+        Acknowledge = 10,
+        Join_lines = 11,
+        Replace_range = 12,
+    };
+
+    static Operation insert_char(size_t line, size_t column, char ch);
+    static Operation delete_char(size_t line, size_t column);
+    static Operation break_line(size_t line, size_t column);
+    static Operation insert_line(size_t line, const std::string& content);
+    static Operation delete_line(size_t line);
+    // Prilepi riadok line + 1 na koniec riadku line
+    static Operation join_lines(size_t line);
+    static Operation move_cursor(size_t id, size_t line, size_t column);
+    // Kotva vyberu cursora, ostatne operacie ju posuvaju ako hlavu
+    static Operation move_anchor(size_t id, size_t line, size_t column);
+    static Operation remove_cursor(size_t id);
+    // Prikazy klienta cursora az po sequence su v dokumente
+    static Operation acknowledge(size_t id, uint64_t sequence);
+    // Zmaze length znakov od (line, column), koniec riadku je jeden znak,
+    //  a na ich miesto vlozi text, moze mat viac riadkov
+    static Operation replace_text(
+        size_t line, size_t column, size_t length, std::string text);
+    // To iste s koncom rozsahu namiesto dlzky. Kolko riadkov uprava
+    //  zasiahne, sa z nej da zistit aj bez ich obsahu.
+    static Operation replace_range(size_t line, size_t column,
+        size_t end_line, size_t end_column, std::string text);
+
+    // Meni text dokumentu, ostatne operacie menia iba cursory
+    bool edits_text() const;
+
+    Type type;
+    size_t line, column, cursor_id;
+    // Pocet zmazanych znakov pri Replace_text
+    size_t length;
+    // Koniec nahradeneho rozsahu pri Replace_range
+    size_t end_line, end_column;
+    // Vlozeny znak, obsah vlozeneho riadku alebo vlozeny text
+    std::string text;
+    // Poradie posledneho prikazu pri Acknowledge
+    uint64_t sequence;
+};
+
+// Operacie, ktore posunu dokument z verzie version - 1 na version
+struct Delta {
+    Delta();
+    // Constructor from payload, deserializes the object
+    Delta(const char* begin, const char* end);
+
+    // Pripise binarny tvar na koniec out
+    void encode(std::string& out) const;
+
+    uint64_t version;
+    std::vector<Operation> operations;
+};
+
+// Binarny protokol. Kazda sprava je frame: 4 bajty dlzky (little endian,
+//  typ + payload), 1 bajt typu a payload. Cisla v payloade su varinty,
+//  texty su varint dlzka a surove bajty.
+namespace Protocol {
+    // Klient posiela v Hello, server odmietne inu verziu
+    const uint64_t VERSION = 5;
+
+    const size_t LENGTH_SIZE = 4;
+    const size_t HEADER_SIZE = LENGTH_SIZE + 1;
+    // Od klienta chodia kratke prikazy, najvacsi je vlozeny blok textu
+    const size_t MAX_CLIENT_FRAME = 1 << 20;
+
+    enum class Message_type : uint8_t {
+        Hello = 1, // klient: verzia protokolu, meno dokumentu, vyska okna
+        Welcome = 2, // server: verzia protokolu, id klienta
+        Error = 3, // server: text chyby, potom zavrie spojenie
+        Image = 4, // server: Document_image
+        Delta = 5, // server: Delta
+        Command = 6, // klient: poradie prikazu a prikaz pre svoj cursor
+        Resync = 7, // klient: chce novy Document_image
+        Viewport = 8, // klient: prvy riadok a vyska okna, chce ich obraz
+    };
+
+    struct Protocol_error : std::runtime_error {
+        using std::runtime_error::runtime_error;
+    };
+
+    void put_varint(std::string& out, uint64_t value);
+    void put_bytes(std::string& out, std::string_view bytes);
+
+    // Zapise hlavicku frame-u, dlzku doplni end_frame
+    size_t begin_frame(std::string& out, Message_type type);
+    void end_frame(std::string& out, size_t frame_begin);
+    std::string frame(Message_type type, std::string_view payload = {});
+
+    // Sprava poskladana z nemennych kusov, posiela sa scatter-gather bez
+    //  skladania do jedneho bufferu. Ten isty kus moze byt vo viacerych
+    //  spravach (cache zakodovanych riadkov).
+    class Chunked_message {
+    public:
+        Chunked_message();
+        explicit Chunked_message(std::string bytes);
+
+        void append(std::string bytes);
+        void append(std::shared_ptr<const std::string> chunk);
+        void append(const Chunked_message& other);
+
+        size_t size() const;
+        const std::vector<std::shared_ptr<const std::string>>& chunks() const;
+
+    private:
+        std::vector<std::shared_ptr<const std::string>> chunks_;
+        size_t size_;
+    };
+
+    // Frame okolo payloadu z kusov, kusy sa nekopiruju
+    Chunked_message frame(Message_type type, const Chunked_message& payload);
+
+    // Meno dokumentu z Hello je zaroven meno suboru na serveri: 1 az 64
+    //  znakov [A-Za-z0-9_.-], nezacina bodkou
+    const size_t MAX_DOCUMENT_NAME = 64;
+    bool valid_document_name(std::string_view name);
+
+    // Dlzka typu a payloadu z prvych LENGTH_SIZE bajtov hlavicky
+    uint32_t frame_length(const char* header);
+
+    // Sklada frame-y z bajtov prijatych po lubovolnych kusoch. Jednym
+    //  citanim do spolocneho bufferu pride aj viac kratkych frame-ov,
+    //  payload, ktory sa do bufferu nezmesti, sa cita rovno do vlastneho
+    //  stringu. Ten si prijemca (obraz) necha bez dalsej kopie.
+    class Frame_decoder {
+    public:
+        Frame_decoder();
+
+        // Kam nacitat dalsie bajty, size je kolko sa tam zmesti
+        char* prepare(size_t& size);
+        // Do prepare sa nacitalo size bajtov
+        void commit(size_t size);
+        // Dalsi cely frame, false ak este nie je cely. Pri chybnej dlzke
+        //  hodi Protocol_error.
+        bool next(Message_type& type,
+            std::shared_ptr<const std::string>& payload);
+
+    private:
+        std::string buffer;
+        // Prijate a este nespracovane bajty v buffer
+        size_t begin, end;
+        // Payload dlheho frame-u a kolko z neho uz prislo
+        std::shared_ptr<std::string> large;
+        size_t large_filled;
+        Message_type large_type;
+
+        static const size_t BUFFER_SIZE = 64 << 10;
+    };
+
+    // Cita payload na mieste, pri chybe hodi Protocol_error
+    class Reader {
+    public:
+        Reader(const char* begin, const char* end);
+
+        uint8_t byte();
+        uint64_t varint();
+        std::string_view bytes(size_t length);
+        // Varint dlzka a za nou bajty
+        std::string_view text();
+        // Vsetko, co este neprecital
+        std::string_view rest();
+        bool done() const;
+
+    private:
+        const char* position;
+        const char* end;
+    };
+}
+
+}
+
+#endif
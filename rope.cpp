@@ -0,0 +1,399 @@
+#include <memory>
+#include <string>
+#include <utility>
+
+#include "file.h"
+#include "rope.h"
+
+namespace Document {
+
+const size_t Rope_storage::SEGMENT_LINES = 256;
+
+struct Rope_storage::Node {
+    Node(std::shared_ptr<Line> text, uint32_t priority)
+        : text(std::move(text))
+        , source(nullptr)
+        , first(0)
+        , count(1)
+        , priority(priority)
+        , size(1)
+    {
+    }
+
+    Node(const Line_source* source, size_t first, size_t count,
+        uint32_t priority)
+        : source(source)
+        , first(first)
+        , count(count)
+        , priority(priority)
+        , size(count)
+    {
+    }
+
+    // Kopia pre unshare. Original moze prave kodovat ine vlakno zo
+    //  snapshotu, encoded sa preto cita atomicky.
+    Node(const Node& other)
+        : text(other.text)
+        , source(other.source)
+        , first(other.first)
+        , count(other.count)
+        , priority(other.priority)
+        , size(other.size)
+        , left(other.left)
+        , right(other.right)
+        , encoded(std::atomic_load(&other.encoded))
+    {
+    }
+
+    Line_view line(size_t offset) const
+    {
+        return source ? Line_view(source->line(first + offset))
+                      : text->view();
+    }
+
+    // Riadok moze zdielat viac snapshotov, upravovat sa smie iba ked ho
+    //  nikto iny nedrzi.
+    std::shared_ptr<Line> text;
+    // Ak source nie je nullptr, uzol je kus namapovaneho suboru: riadky
+    //  first .. first + count - 1 zo zdroja, ktore este nikto neupravil.
+    //  Inak je to jeden riadok v text.
+    const Line_source* source;
+    size_t first, count;
+    uint32_t priority;
+    // Pocet riadkov v podstrome
+    size_t size;
+    Node_ptr left, right;
+    // Riadky uzla zakodovane pre Document_image, nullptr ak este neboli
+    //  alebo sa odvtedy uzol zmenil. Uzol moze zdielat snapshot kodovany
+    //  v inom vlakne, preto sa pristupuje atomicky.
+    mutable std::shared_ptr<const std::string> encoded;
+
+    // Uzol sa zmenil, zakodovane riadky neplatia
+    void invalidate()
+    {
+        std::atomic_store(&encoded, std::shared_ptr<const std::string>());
+    }
+};
+
+Rope_storage::Rope_storage()
+    : seed(2463534242u)
+{
+    root = make_node(Line());
+}
+
+Rope_storage::Rope_storage(const Rope_storage& other) = default;
+
+Rope_storage::~Rope_storage() = default;
+
+size_t Rope_storage::size(const Node_ptr& node)
+{
+    return node ? node->size : 0;
+}
+
+void Rope_storage::update(Node& node)
+{
+    node.size = node.count + size(node.left) + size(node.right);
+}
+
+void Rope_storage::unshare(Node_ptr& node)
+{
+    // uzol drzi aj nejaky snapshot, upravime vlastnu kopiu
+    if (node and node.use_count() > 1)
+        node = std::make_shared<Node>(*node);
+}
+
+void Rope_storage::split(
+    Node_ptr node, size_t count, Node_ptr& left, Node_ptr& right)
+{
+    if (!node) {
+        left = nullptr;
+        right = nullptr;
+        return;
+    }
+
+    unshare(node);
+    size_t left_size = size(node->left);
+    if (count <= left_size) {
+        Node_ptr rest;
+        split(std::move(node->left), count, left, rest);
+        if (rest and rest->priority > node->priority) {
+            // v rest je novy kus zo stredu rezu s vyssou prioritou, uzol
+            //  musi ist pod neho
+            node->left = nullptr;
+            update(*node);
+            right = merge(std::move(rest), std::move(node));
+        } else {
+            node->left = std::move(rest);
+            update(*node);
+            right = std::move(node);
+        }
+    } else if (count >= left_size + node->count) {
+        Node_ptr rest;
+        split(std::move(node->right), count - left_size - node->count, rest,
+            right);
+        node->right = std::move(rest);
+        update(*node);
+        left = std::move(node);
+    } else {
+        // rez vo vnutri kusu suboru, druha polovica bude novy uzol
+        size_t cut = count - left_size;
+        // Novy kus dostane vlastnu nahodnu prioritu. Zdedena priorita by
+        //  pri opakovanom rezani toho isteho kusu vytvarala retaze uzlov
+        //  s rovnakou prioritou a strom by sa zvrhol na zoznam. Haldu nad
+        //  nim opravia predkovia pri zlucovani.
+        Node_ptr tail = std::make_shared<Node>(node->source,
+            node->first + cut, node->count - cut, next_priority());
+        node->count = cut;
+        node->invalidate();
+        right = merge(std::move(tail), std::move(node->right));
+        update(*node);
+        left = std::move(node);
+    }
+}
+
+Rope_storage::Node_ptr Rope_storage::merge(Node_ptr left, Node_ptr right)
+{
+    if (!left)
+        return right;
+    if (!right)
+        return left;
+
+    if (left->priority > right->priority) {
+        unshare(left);
+        left->right = merge(std::move(left->right), std::move(right));
+        update(*left);
+        return left;
+    }
+    unshare(right);
+    right->left = merge(std::move(left), std::move(right->left));
+    update(*right);
+    return right;
+}
+
+const Rope_storage::Node& Rope_storage::locate(
+    size_t line, size_t& offset) const
+{
+    const Node* node = root.get();
+    for (;;) {
+        size_t left_size = size(node->left);
+        if (line < left_size)
+            node = node->left.get();
+        else if (line < left_size + node->count) {
+            offset = line - left_size;
+            return *node;
+        } else {
+            line -= left_size + node->count;
+            node = node->right.get();
+        }
+    }
+}
+
+Line_view Rope_storage::view(size_t line) const
+{
+    size_t offset;
+    return locate(line, offset).line(offset);
+}
+
+Line& Rope_storage::owned(size_t line)
+{
+    size_t offset;
+    if (locate(line, offset).source) {
+        // riadok z kusu suboru vyrezeme do samostatneho uzla
+        Node_ptr left, middle, right;
+        split(std::move(root), line, left, right);
+        split(std::move(right), 1, middle, right);
+        middle->text = std::make_shared<Line>(middle->line(0));
+        middle->source = nullptr;
+        middle->first = 0;
+        middle->invalidate();
+        // samostatny uzol sa zaradi podla novej nahodnej priority
+        middle->priority = next_priority();
+        // uzol aj text su nove, snapshot ich nezdiela
+        Line& text = *middle->text;
+        root = merge(
+            merge(std::move(left), std::move(middle)), std::move(right));
+        return text;
+    }
+
+    // cestu od korena k riadku si skopirujeme, ak ju zdiela snapshot
+    Node_ptr* node = &root;
+    for (;;) {
+        unshare(*node);
+        size_t left_size = size((*node)->left);
+        if (line < left_size)
+            node = &(*node)->left;
+        else if (line < left_size + (*node)->count)
+            break;
+        else {
+            line -= left_size + (*node)->count;
+            node = &(*node)->right;
+        }
+    }
+
+    // volajuci riadok zmeni
+    (*node)->invalidate();
+    std::shared_ptr<Line>& text = (*node)->text;
+    if (text.use_count() > 1)
+        text = std::make_shared<Line>(*text);
+    return *text;
+}
+
+uint32_t Rope_storage::next_priority()
+{
+    // xorshift, priority nemusia byt kvalitne nahodne
+    seed ^= seed << 13;
+    seed ^= seed >> 17;
+    seed ^= seed << 5;
+    return seed;
+}
+
+Rope_storage::Node_ptr Rope_storage::make_node(Line content)
+{
+    return std::make_shared<Node>(
+        std::make_shared<Line>(std::move(content)), next_priority());
+}
+
+void Rope_storage::for_each_node(
+    const std::function<void(const Node&)>& f) const
+{
+    // in-order prechod, hlbka stromu je O(log lines)
+    std::function<void(const Node*)> visit = [&](const Node* node) {
+        if (!node)
+            return;
+        visit(node->left.get());
+        f(*node);
+        visit(node->right.get());
+    };
+    visit(root.get());
+}
+
+size_t Rope_storage::lines_count() const { return size(root); }
+
+size_t Rope_storage::line_length(size_t line) const
+{
+    return view(line).length();
+}
+
+std::string Rope_storage::line(size_t line) const { return view(line).str(); }
+
+void Rope_storage::for_each_line(
+    const std::function<void(const Line_view&)>& f) const
+{
+    for_each_node([&f](const Node& node) {
+        for (size_t i = 0; i < node.count; ++i)
+            f(node.line(i));
+    });
+}
+
+void Rope_storage::encode_lines(Protocol::Chunked_message& out) const
+{
+    for_each_node([&out](const Node& node) {
+        std::shared_ptr<const std::string> encoded
+            = std::atomic_load(&node.encoded);
+        if (!encoded) {
+            std::string chunk;
+            for (size_t i = 0; i < node.count; ++i) {
+                Line_view line = node.line(i);
+                Protocol::put_varint(chunk, line.length());
+                line.append_to(chunk);
+            }
+            encoded = std::make_shared<const std::string>(std::move(chunk));
+            std::atomic_store(&node.encoded, encoded);
+        }
+        out.append(std::move(encoded));
+    });
+}
+
+size_t Rope_storage::memory_usage() const
+{
+    // Namapovane subory sa nerataju, patria page cache. Uzly zdielane so
+    //  snapshotmi sa ratuju cele.
+    size_t usage = sizeof(*this);
+    for_each_node([&usage](const Node& node) {
+        usage += sizeof(Node);
+        if (node.text)
+            usage += sizeof(Line) + node.text->capacity();
+        if (auto encoded = std::atomic_load(&node.encoded))
+            usage += sizeof(std::string) + encoded->capacity();
+    });
+    return usage;
+}
+
+std::unique_ptr<Storage> Rope_storage::copy() const
+{
+    // zdielame koren, upravy si cestu k riadku skopiruju (copy-on-write)
+    return std::make_unique<Rope_storage>(*this);
+}
+
+void Rope_storage::load(std::shared_ptr<const Line_source> source)
+{
+    sources.push_back(source);
+
+    // Zdroj rozdelime na kusy po SEGMENT_LINES riadkov, aby bol strom od
+    //  zaciatku vyvazeny. Samotne riadky sa citaju az pri pristupe.
+    root = nullptr;
+    for (size_t first = 0; first < source->lines_count();
+         first += SEGMENT_LINES) {
+        size_t count = std::min(SEGMENT_LINES, source->lines_count() - first);
+        root = merge(std::move(root),
+            std::make_shared<Node>(
+                source.get(), first, count, next_priority()));
+    }
+}
+
+void Rope_storage::insert_line(size_t line, const std::string& content)
+{
+    Node_ptr left, right;
+    split(std::move(root), line, left, right);
+    root = merge(
+        merge(std::move(left), make_node(Line(content))), std::move(right));
+}
+
+void Rope_storage::delete_line(size_t line)
+{
+    Node_ptr left, middle, right;
+    split(std::move(root), line, left, right);
+    split(std::move(right), 1, middle, right);
+    root = merge(std::move(left), std::move(right));
+}
+
+void Rope_storage::break_line(size_t line, size_t column)
+{
+    Line new_line = owned(line).split(column);
+
+    Node_ptr left, right;
+    split(std::move(root), line + 1, left, right);
+    root = merge(merge(std::move(left), make_node(std::move(new_line))),
+        std::move(right));
+}
+
+void Rope_storage::join_lines(size_t line)
+{
+    Line next_line(view(line + 1));
+    delete_line(line + 1);
+    owned(line).append(next_line.view());
+}
+
+void Rope_storage::insert_char(size_t line, size_t column, char ch)
+{
+    owned(line).insert(column, ch);
+}
+
+void Rope_storage::delete_char(size_t line, size_t column)
+{
+    owned(line).erase(column);
+}
+
+void Rope_storage::replace_lines(
+    size_t line, size_t count, const std::vector<std::string>& content)
+{
+    // vystrihne stare riadky a na ich miesto vlozi podstrom z novych
+    Node_ptr left, middle, right;
+    split(std::move(root), line, left, right);
+    split(std::move(right), count, middle, right);
+    for (auto&& text : content)
+        left = merge(std::move(left), make_node(Line(text)));
+    root = merge(std::move(left), std::move(right));
+}
+
+}
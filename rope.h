@@ -0,0 +1,78 @@
+#ifndef M_ROPE
+#define M_ROPE
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "storage.h"
+
+namespace Document {
+
+// Vyvazeny strom riadkov (implicitny treap). Kluc uzla je jeho poradie v
+//  in-order prechode, takze vlozenie aj zmazanie riadku je O(log lines) a
+//  nic sa neposuva. Riadky su gap buffre, editovanie znakov je teda
+//  O(log lines) na najdenie riadku a amortizovane O(1) na samotny edit.
+// Uzly aj riadky su zdielane cez shared_ptr a upravuju sa copy-on-write,
+//  takze kopia aj snapshot su iba kopia korena, O(1).
+// Nacitany zdroj (namapovany subor, prijaty obraz) si strom ponecha, uzly
+//  odkazuju na kusy jeho riadkov a riadok sa skopiruje do vlastneho gap
+//  bufferu az pri prvej uprave.
+// Kazdy uzol si pamata svoje riadky zakodovane pre Document_image, uprava
+//  zahodi iba cache upraveneho uzla.
+class Rope_storage : public Storage {
+public:
+    Rope_storage();
+    Rope_storage(const Rope_storage& other);
+    ~Rope_storage() override;
+
+    size_t lines_count() const override;
+    size_t line_length(size_t line) const override;
+    std::string line(size_t line) const override;
+    void for_each_line(
+        const std::function<void(const Line_view&)>& f) const override;
+    void encode_lines(Protocol::Chunked_message& out) const override;
+    size_t memory_usage() const override;
+    std::unique_ptr<Storage> copy() const override;
+
+    void load(std::shared_ptr<const Line_source> source) override;
+    void insert_line(size_t line, const std::string& content) override;
+    void delete_line(size_t line) override;
+    void break_line(size_t line, size_t column) override;
+    void join_lines(size_t line) override;
+    void insert_char(size_t line, size_t column, char ch) override;
+    void delete_char(size_t line, size_t column) override;
+    void replace_lines(size_t line, size_t count,
+        const std::vector<std::string>& content) override;
+
+private:
+    struct Node;
+    using Node_ptr = std::shared_ptr<Node>;
+
+    static size_t size(const Node_ptr& node);
+    static void update(Node& node);
+    static void unshare(Node_ptr& node);
+    // Prvych count riadkov pojde do left, zvysok do right
+    void split(Node_ptr node, size_t count, Node_ptr& left, Node_ptr& right);
+    static Node_ptr merge(Node_ptr left, Node_ptr right);
+
+    // Uzol s riadkom line, offset je poradie riadku v uzle
+    const Node& locate(size_t line, size_t& offset) const;
+    Line_view view(size_t line) const;
+    // Riadok line vo vlastnom, nezdielanom uzle, aby sa dal upravovat
+    Line& owned(size_t line);
+    void for_each_node(const std::function<void(const Node&)>& f) const;
+    uint32_t next_priority();
+    Node_ptr make_node(Line content);
+
+    Node_ptr root;
+    std::vector<std::shared_ptr<const Line_source>> sources;
+    uint32_t seed;
+
+    static const size_t SEGMENT_LINES;
+};
+
+}
+
+#endif
@@ -3,64 +3,463 @@
 #include <boost/enable_shared_from_this.hpp>
 #include <boost/shared_ptr.hpp>
 #include <boost/thread/thread.hpp>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <ctime>
+#include <deque>
+#include <filesystem>
 #include <functional>
 #include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sstream>
 #include <string>
+#include <thread>
+#include <vector>
 
 #include "document.h"
+#include "file.h"
+#include "log.h"
+#include "mpsc_ring.h"
+#include "wal.h"
 
 using boost::asio::ip::tcp;
+namespace Protocol = Document::Protocol;
+
+// Zakodovana sprava, nemenna, zdielana medzi frontami vsetkych spojeni
+using Outbound_message = std::shared_ptr<const Protocol::Chunked_message>;
+
+// Upravy jedneho dokumentu bezia postupne na jeho strande, rozne
+//  dokumenty, sockety a kodovanie na lubovolnom vlakne poolu
+using Strand = boost::asio::strand<boost::asio::io_context::executor_type>;
+
+class Tcp_connection;
+
+// Pocty za jeden interval statistik, podla nich sa ladi tick
+struct Broadcast_stats {
+    size_t commands, broadcasts, max_batch;
+};
+
+// Vsetko, co klient robi s dokumentom, v poradi, v akom to poslal
+struct Queued_command {
+    enum class Kind { Join, Command, Resync, Viewport, Leave };
+
+    Kind kind;
+    boost::shared_ptr<Tcp_connection> connection;
+    std::string message;
+    // Poradie prikazu u klienta, potvrdi sa mu v delte
+    uint64_t sequence;
+};
+
+// Dokument otvoreny na serveri. Sietove vlakna zaraduju prikazy do ringu
+//  bez zamkov, na strande dokumentu ich po davkach aplikuje jediny drain.
+//  Poradie v ringu je poradie aplikovania. Kazda odoslana delta ide aj do
+//  logu, snapshot na pozadi ho potom skrati.
+struct Hosted_document : std::enable_shared_from_this<Hosted_document> {
+    Hosted_document(boost::asio::io_context& io_context, Document::Wal& wal,
+        std::string name, std::string path, Document::Storage_type type,
+        std::chrono::milliseconds tick)
+        : name(std::move(name))
+        , path(std::move(path))
+        , strand(boost::asio::make_strand(io_context))
+        , wal(wal)
+        , loaded(false)
+        , clients(0)
+        , last_active(std::chrono::steady_clock::now())
+        , evicting(false)
+        , handler(type)
+        , closed(false)
+        , snapshotting(false)
+        , logged(0)
+        , commands(COMMANDS_CAPACITY)
+        , draining(false)
+        , tick(tick)
+        , tick_timer(strand)
+        , tick_armed(false)
+        , last_broadcast()
+        , batched(0)
+        , broadcast_stats { 0, 0, 0 }
+    {
+    }
+
+    // Z lubovolneho vlakna. Ak je ring plny, vrati false a prikaz necha
+    //  tak, odosielatel ho skusi znova.
+    bool submit(Queued_command& command);
+
+    // Prikaz zmenil dokument. Prvy po necinnom ticku ide von hned, dalsie
+    //  sa zbieraju do konca ticku a odidu jednou deltou.
+    void schedule_broadcast();
+    // Posle neodoslane operacie hned, napr. pred obrazom, ktory na ne
+    //  nadvazuje
+    void broadcast_changes();
+    // Vrati pocty od posledneho volania a vynuluje ich
+    Broadcast_stats take_broadcast_stats();
+
+    // Na strande, pred vsetkymi prikazmi: snapshot (namapovany, riadky
+    //  sa citaju az pri pristupe) a za nim delty z logu
+    void load();
+
+    // Ulozi nemenny pohlad na obsah na inom vlakne a potvrdi ho v logu,
+    //  dokument sa medzitym dalej upravuje. done(ok) pobezi na strande.
+    //  Pocas beziaceho snapshotu sa dalsi zaradi za neho.
+    void snapshot(std::function<void(bool)> done);
+    // Pocka, kym vlakno logu zapise a zavrie log dokumentu
+    void close_log();
+    // Znova otvori log zavrety pri vyradeni, ku ktoremu nakoniec nedoslo
+    void reopen_log();
+    // Pri ukonceni servera, na strande: dalsie prikazy sa uz neaplikuju,
+    //  takze posledny snapshot obsahuje vsetko, co klienti videli. Potom
+    //  zavrie log a zavola done.
+    void shutdown(std::function<void()> done);
+
+    const std::string name;
+    const std::string path;
+    Strand strand;
+    Document::Wal& wal;
+
+    // Ak sa subor nepodari nacitat, neuklada sa, aby sa neprepisal
+    bool loaded;
+
+    // Pod mutexom shardu registra
+    size_t clients;
+    std::chrono::steady_clock::time_point last_active;
+    bool evicting;
+
+    // Zvysok iba na strande dokumentu
+    Document::Document_handler handler;
+    // Pripojeni klienti, ktori uz dostavaju delty
+    std::map<int, boost::shared_ptr<Tcp_connection>> connections;
+    std::shared_ptr<Document::Wal_log> log;
+
+private:
+    void drain();
+    void apply(Queued_command& command);
+    void send_delta(const Outbound_message& message);
+    // Obraz okna klienta s rezervou na obe strany, bez okna cely dokument
+    Document::Document_image image_for(const Tcp_connection& connection) const;
+
+    // Po shutdown sa prikazy zahadzuju
+    bool closed;
+    bool snapshotting;
+    // Snapshoty vyziadane pocas beziaceho
+    std::vector<std::function<void(bool)>> waiting;
+    // Bajty v logu od posledneho snapshotu
+    size_t logged;
+
+    Document::Mpsc_ring<Queued_command> commands;
+    // Drain je naplanovany alebo bezi
+    std::atomic<bool> draining;
+
+    const std::chrono::milliseconds tick;
+    boost::asio::steady_timer tick_timer;
+    bool tick_armed;
+    std::chrono::steady_clock::time_point last_broadcast;
+    // Prikazy v neodoslanej delte
+    size_t batched;
+    Broadcast_stats broadcast_stats;
+
+    static const size_t COMMANDS_CAPACITY = 512;
+    // Log dlhsi ako toto sa skrati snapshotom
+    static const size_t SNAPSHOT_LOG_BYTES = 16 << 20;
+    // Po tolkych prikazoch drain pusti na strand aj tick timer
+    static const size_t DRAIN_BATCH = 64;
+    // Rezerva okna v obrazovkach nad aj pod tym, co klient vidi
+    static const size_t PREFETCH_PAGES = 2;
+    // Vyssie okno od klienta sa oreze
+    static constexpr size_t MAX_VIEW_HEIGHT = 1 << 16;
+};
+
+// Otvorene dokumenty podla mena. Mapa je rozdelena na shardy s vlastnym
+//  mutexom, pripajanie k roznym dokumentom sa nebije o jeden zamok.
+//  Dokument bez klientov sa po IDLE_TIMEOUT ulozi a uvolni z pamate,
+//  dalsie pripojenie ho znova nacita z disku.
+class Document_registry {
+public:
+    Document_registry(boost::asio::io_context& io_context, Document::Wal& wal,
+        Document::Storage_type storage_type, std::string data_dir,
+        size_t shards_count, std::chrono::seconds idle_timeout,
+        std::chrono::milliseconds tick)
+        : io_context(io_context)
+        , wal(wal)
+        , storage_type(storage_type)
+        , closing(false)
+        , data_dir(std::move(data_dir))
+        , idle_timeout(idle_timeout)
+        , tick(tick)
+    {
+        for (size_t i = 0; i < shards_count; ++i)
+            shards.push_back(std::make_unique<Shard>());
+    }
+
+    Document_registry& operator=(const Document_registry&) = delete;
+
+    // Zarata klienta, neotvoreny dokument vytvori a nacita na jeho strande.
+    //  Pri ukonceni servera vrati nullptr.
+    std::shared_ptr<Hosted_document> acquire(const std::string& name)
+    {
+        Shard& shard = shard_of(name);
+        std::lock_guard<std::mutex> lock(shard.mtx);
+        if (closing)
+            return nullptr;
+        std::shared_ptr<Hosted_document>& document = find_or_load(shard, name);
+        ++document->clients;
+        return document;
+    }
+
+    // Po starte, ked server uz pocuva: dokumenty, ktorym v logu ostali
+    //  delty, sa nacitaju hned, kazdy na svojom strande, teda paralelne.
+    //  Klient takeho dokumentu pocka v ringu, kym sa nacita, ostatne
+    //  dokumenty sa nacitaju az pri prvom pripojeni.
+    void preload()
+    {
+        std::vector<std::string> names;
+        for (auto&& entry : std::filesystem::directory_iterator(data_dir)) {
+            std::string file = entry.path().filename().string();
+            if (file.size() <= 4 or file.compare(file.size() - 4, 4, ".wal"))
+                continue;
+            std::string name = file.substr(0, file.size() - 4);
+            if (Protocol::valid_document_name(name)
+                and !Document::is_wal_file_name(name)
+                and Document::Wal::has_tail(data_dir + "/" + name))
+                names.push_back(name);
+        }
+        if (names.empty())
+            return;
+
+        LOG(Info, "Recovering " + std::to_string(names.size()) + " documents");
+        auto start = std::chrono::steady_clock::now();
+        auto remaining = std::make_shared<std::atomic<size_t>>(names.size());
+        for (auto&& name : names) {
+            Shard& shard = shard_of(name);
+            std::lock_guard<std::mutex> lock(shard.mtx);
+            std::shared_ptr<Hosted_document> document
+                = find_or_load(shard, name);
+            boost::asio::post(document->strand,
+                [remaining, start, count = names.size()]() {
+                    if (--*remaining != 0)
+                        return;
+                    auto elapsed = std::chrono::steady_clock::now() - start;
+                    LOG(Info,
+                        "Recovered " + std::to_string(count)
+                            + " documents in "
+                            + std::to_string(std::chrono::duration_cast<
+                                std::chrono::milliseconds>(elapsed)
+                                                 .count())
+                            + " ms");
+                });
+        }
+    }
+
+    // Na strande dokumentu. Dokument, ktory sa nepodarilo nacitat, sa po
+    //  odchode posledneho klienta zabudne, dalsie pripojenie ho skusi
+    //  nacitat znova.
+    void release(Hosted_document& document)
+    {
+        Shard& shard = shard_of(document.name);
+        std::lock_guard<std::mutex> lock(shard.mtx);
+        --document.clients;
+        document.last_active = std::chrono::steady_clock::now();
+        auto it = shard.documents.find(document.name);
+        if (!document.loaded and document.clients == 0
+            and it != shard.documents.end() and it->second.get() == &document)
+            shard.documents.erase(it);
+    }
+
+    // Ulozi necinne dokumenty bez klientov a zabudne ich
+    void evict_idle()
+    {
+        auto now = std::chrono::steady_clock::now();
+        for (auto&& shard : shards) {
+            std::lock_guard<std::mutex> lock(shard->mtx);
+            for (auto&& entry : shard->documents) {
+                std::shared_ptr<Hosted_document> document = entry.second;
+                if (document->clients != 0 or document->evicting
+                    or now - document->last_active < idle_timeout)
+                    continue;
+                document->evicting = true;
+                boost::asio::post(document->strand,
+                    [this, document]() { evict(document); });
+            }
+        }
+    }
+
+    // Ulozi snapshot kazdeho dokumentu a zavrie jeho log, done sa zavola
+    //  po poslednom
+    void save_all(std::function<void()> done)
+    {
+        // dokument otvoreny az po all() by uz nikto neulozil
+        closing = true;
+        std::vector<std::shared_ptr<Hosted_document>> documents = all();
+        if (documents.empty())
+            return done();
+        auto remaining = std::make_shared<std::atomic<size_t>>(
+            documents.size());
+        for (auto&& document : documents)
+            boost::asio::post(
+                document->strand, [document, remaining, done]() {
+                    document->shutdown([remaining, done]() {
+                        if (--*remaining == 0)
+                            done();
+                    });
+                });
+    }
+
+    // f dostane kazdy dokument na jeho strande
+    void for_each(const std::function<void(Hosted_document&)>& f)
+    {
+        for (auto&& document : all())
+            boost::asio::post(
+                document->strand, [document, f]() { f(*document); });
+    }
+
+    size_t size()
+    {
+        size_t count = 0;
+        for (auto&& shard : shards) {
+            std::lock_guard<std::mutex> lock(shard->mtx);
+            count += shard->documents.size();
+        }
+        return count;
+    }
+
+private:
+    struct Shard {
+        std::mutex mtx;
+        std::map<std::string, std::shared_ptr<Hosted_document>> documents;
+    };
+
+    Shard& shard_of(const std::string& name)
+    {
+        return *shards[std::hash<std::string>()(name) % shards.size()];
+    }
+
+    // Pod mutexom shardu, neotvoreny dokument vytvori a nacita na strande
+    std::shared_ptr<Hosted_document>& find_or_load(
+        Shard& shard, const std::string& name)
+    {
+        std::shared_ptr<Hosted_document>& document = shard.documents[name];
+        if (!document) {
+            document = std::make_shared<Hosted_document>(io_context, wal,
+                name, data_dir + "/" + name, storage_type, tick);
+            // vsetko, co klient posle na strand, pride az po nacitani
+            boost::asio::post(document->strand,
+                [document = document]() { document->load(); });
+        }
+        return document;
+    }
+
+    std::vector<std::shared_ptr<Hosted_document>> all()
+    {
+        std::vector<std::shared_ptr<Hosted_document>> documents;
+        for (auto&& shard : shards) {
+            std::lock_guard<std::mutex> lock(shard->mtx);
+            for (auto&& entry : shard->documents)
+                documents.push_back(entry.second);
+        }
+        return documents;
+    }
+
+    // Na strande dokumentu. Snapshot sa robi pred vyradenim z mapy, aby
+    //  novy dokument s rovnakym menom nacital kratky log. Klient sa moze
+    //  medzitym pripojit, potom dokument ostava.
+    void evict(const std::shared_ptr<Hosted_document>& document)
+    {
+        document->snapshot([this, document](bool saved) {
+            // log sa zavrie skor, ako dokument s tym istym menom moze
+            //  zacat obnovu z neho, ale bez zamku shardu: Wal::close caka
+            //  na fsync a zamok by zdrzal pripajanie k celemu shardu
+            if (saved)
+                document->close_log();
+            Shard& shard = shard_of(document->name);
+            bool evicted;
+            {
+                std::lock_guard<std::mutex> lock(shard.mtx);
+                document->evicting = false;
+                // nenacitany dokument nema co ulozit
+                evicted = (saved or !document->loaded)
+                    and document->clients == 0;
+                if (evicted)
+                    shard.documents.erase(document->name);
+            }
+            if (evicted)
+                LOG(Info, "Evicted " + document->name);
+            else
+                // medzitym sa pripojil klient, jeho Join caka na strande
+                document->reopen_log();
+        });
+    }
+
+    boost::asio::io_context& io_context;
+    Document::Wal& wal;
+    Document::Storage_type storage_type;
+    // Zacalo ukoncenie, nove dokumenty sa neotvaraju
+    std::atomic<bool> closing;
+    std::string data_dir;
+    std::chrono::seconds idle_timeout;
+    std::chrono::milliseconds tick;
+    std::vector<std::unique_ptr<Shard>> shards;
+};
 
 class Tcp_connection : public boost::enable_shared_from_this<Tcp_connection> {
 public:
-    // typedef boost::shared_ptr<Tcp_connection> pointer;
+    typedef boost::shared_ptr<Tcp_connection> pointer;
 
-    static std::unique_ptr<Tcp_connection> create(
-        boost::asio::io_context& io_context,
-        const std::function<void(std::string)>& send_all, int id)
+    static pointer create(boost::asio::io_context& io_context,
+        Document_registry& registry, int id)
     {
-        return std::unique_ptr<Tcp_connection> { new Tcp_connection(
-            io_context, send_all, id) };
+        return pointer(new Tcp_connection(io_context, registry, id));
     }
 
+    // Vola sa na strande spojenia
     void start()
     {
-        // debug output
-        debug_output("Client connected");
-
-        // prida cursor do dokumentu
-        Document::Document_handler::add_new_cursor(id);
+        LOG(Info, tag() + "Client connected");
 
         // connection je up, da sa posielat
         alive = true;
 
-        // Send id
-        std::stringstream ss;
-        ss << id;
+        // zacne receive loop, cursor dostane klient az po Hello
+        read_header();
+    }
 
-        send(ss.str());
+    // posli daco clientovi
+    void send(Protocol::Message_type type, std::string frame)
+    {
+        send(type,
+            std::make_shared<const Protocol::Chunked_message>(
+                std::move(frame)));
+    }
 
-        // zacne receive loop
-        boost::asio::async_read(socket,
-            boost::asio::buffer(rec_buff_, DEFAULT_MESSAGE_LENGTH),
-            boost::bind(&Tcp_connection::handle_read, this,
-                boost::asio::placeholders::error,
-                boost::asio::placeholders::bytes_transferred));
+    // Sprava sa nekopiruje, fronta drzi iba referenciu na zdielany buffer.
+    //  Pomalemu klientovi sa stav zlucuje: novy obraz nahradi vsetky stare
+    //  stavy vo fronte a pri zaostani sa delty zahodia, klient potom
+    //  dostane jeden novy obraz. Da sa volat z lubovolneho vlakna.
+    void send(Protocol::Message_type type, Outbound_message message)
+    {
+        queue(Outbound_entry { type, std::move(message), nullptr });
     }
 
-    // posli daco clientovi
-    void send(std::string message)
+    // Obraz sa zakoduje az na strande spojenia tesne pred zapisom, takze
+    //  strand dokumentu ho iba zaradi a obraz nahradeny novsim sa
+    //  nekoduje vobec
+    void send_image(Document::Document_image image)
     {
-        mtx.lock();
-        if (!is_alive())
-            debug_output("Connection not alive. Skipping sending...");
-        else
-            boost::asio::async_write(socket, boost::asio::buffer(message),
-                boost::bind(&Tcp_connection::handle_write_empty, this,
-                    boost::asio::placeholders::error,
-                    boost::asio::placeholders::bytes_transferred));
-        mtx.unlock();
+        queue(Outbound_entry { Protocol::Message_type::Image, nullptr,
+            std::make_shared<const Document::Document_image>(
+                std::move(image)) });
+    }
+
+    struct Queue_stats {
+        size_t messages, bytes;
+        bool lagging;
+    };
+
+    Queue_stats queue_stats()
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        return Queue_stats { outbound.size(), queued_bytes, lagging };
     }
 
     bool is_alive() const { return alive; }
@@ -69,144 +468,853 @@ public:
 
     int get_id() const { return id; }
 
+    // Drain dokumentu aplikoval Leave, dokument uz tohto klienta nepozna
+    void left() { registry.release(*document); }
+
+    // Z lubovolneho vlakna: posle Error a zavrie spojenie
+    void refuse(const std::string& message)
+    {
+        boost::asio::post(socket.get_executor(),
+            [self = shared_from_this(), message]() {
+                self->send_error(message);
+            });
+    }
+
     Tcp_connection& operator=(const Tcp_connection&)
         = delete; // nekopirovatelne
 
-    ~Tcp_connection() { Document::Document_handler::remove_cursor(id); }
-
     tcp::socket socket;
+    // Okno klienta, vyska 0 je cely dokument. Nastavi sa pri Hello, potom
+    //  ho meni iba strand dokumentu.
+    size_t view_first, view_height;
 
 private:
+    struct Outbound_entry {
+        Protocol::Message_type type;
+        // nullptr, kym sa obraz nezakoduje
+        Outbound_message message;
+        std::shared_ptr<const Document::Document_image> image;
+    };
+
     Tcp_connection(boost::asio::io_context& io_context,
-        const std::function<void(std::string)>& send_all, int id)
-        : socket(io_context)
-        , rec_buff_(std::string(DEFAULT_MESSAGE_LENGTH, ' '))
-        , send_all(send_all)
+        Document_registry& registry, int id)
+        : socket(boost::asio::make_strand(io_context))
+        , view_first(0)
+        , view_height(0)
+        , registry(registry)
+        , retry_timer(socket.get_executor())
+        , read_paused(false)
         , id(id)
         , alive(false)
         , expired(false)
+        , welcomed(false)
+        , writing(false)
+        , closing(false)
+        , in_flight(0)
+        , queued_bytes(0)
+        , delta_bytes(0)
+        , lagging(false)
+        , last_progress(std::chrono::steady_clock::now())
     {
     }
 
-    void handle_read(
+    void queue(Outbound_entry entry)
+    {
+        mtx.lock();
+        if (!is_alive())
+            LOG(Debug, tag() + "Connection not alive. Skipping sending...");
+        else {
+            // zaostavajucemu klientovi deltu pokryje obraz po dobehnuti
+            if (entry.type != Protocol::Message_type::Delta or !lagging)
+                enqueue(std::move(entry));
+
+            if (lagging
+                and std::chrono::steady_clock::now() - last_progress
+                    > STUCK_TIMEOUT) {
+                // dlho sa nic neodoslalo, klient je zaseknuty
+                LOG(Warning, tag() + "Client stuck, disconnecting");
+                alive = false;
+                boost::asio::post(socket.get_executor(),
+                    [self = shared_from_this()]() {
+                        boost::system::error_code ignored;
+                        self->socket.close(ignored);
+                    });
+            } else if (!writing) {
+                // socket sa smie pouzivat iba na strande spojenia
+                writing = true;
+                boost::asio::post(socket.get_executor(),
+                    boost::bind(
+                        &Tcp_connection::start_write, shared_from_this()));
+            }
+        }
+        mtx.unlock();
+    }
+
+    // Volat s drzanym mtx
+    void enqueue(Outbound_entry entry)
+    {
+        if (entry.type == Protocol::Message_type::Image)
+            drop_queued_state();
+        if (entry.message) {
+            queued_bytes += entry.message->size();
+            if (entry.type == Protocol::Message_type::Delta)
+                delta_bytes += entry.message->size();
+        }
+        outbound.push_back(std::move(entry));
+
+        if (delta_bytes > HIGH_WATERMARK) {
+            LOG(Info, tag() + "Client lagging, dropping queued deltas");
+            lagging = true;
+            drop_queued_state();
+        }
+    }
+
+    // Vsetko, co je vo fronte, ide jednym scatter-gather zapisom. Dalsi
+    //  zapis zacne az v handle_write, na sockete je vzdy najviac jeden.
+    //  Bezi na strande spojenia.
+    void start_write()
+    {
+        mtx.lock();
+        if (outbound.empty()) {
+            writing = false;
+            mtx.unlock();
+            return;
+        }
+        last_progress = std::chrono::steady_clock::now();
+        in_flight = outbound.size();
+        std::vector<std::pair<size_t,
+            std::shared_ptr<const Document::Document_image>>>
+            images;
+        for (size_t i = 0; i < in_flight; ++i)
+            if (!outbound[i].message)
+                images.emplace_back(i, outbound[i].image);
+        mtx.unlock();
+
+        // kodovanie obrazu nedrzi mtx, strand dokumentu medzitym moze
+        //  zaradovat dalej, prvych in_flight sprav nikto iny nemeni
+        std::vector<Outbound_message> encoded;
+        for (auto&& image : images) {
+            Protocol::Chunked_message payload;
+            image.second->encode(payload);
+            encoded.push_back(
+                std::make_shared<const Protocol::Chunked_message>(
+                    Protocol::frame(Protocol::Message_type::Image, payload)));
+        }
+
+        mtx.lock();
+        for (size_t i = 0; i < images.size(); ++i) {
+            Outbound_entry& entry = outbound[images[i].first];
+            entry.message = std::move(encoded[i]);
+            entry.image = nullptr;
+            queued_bytes += entry.message->size();
+        }
+        std::vector<boost::asio::const_buffer> buffers;
+        for (size_t i = 0; i < in_flight; ++i)
+            for (auto&& chunk : outbound[i].message->chunks())
+                buffers.push_back(boost::asio::buffer(*chunk));
+        mtx.unlock();
+
+        boost::asio::async_write(socket, buffers,
+            boost::bind(&Tcp_connection::handle_write, shared_from_this(),
+                boost::asio::placeholders::error,
+                boost::asio::placeholders::bytes_transferred));
+    }
+
+    void handle_write(
         const boost::system::error_code& error, size_t /*bytes_transferred*/)
     {
-        // error handling
+        bool closed = false;
+        bool resync = false;
+        bool more = false;
+        mtx.lock();
+        for (size_t i = 0; i < in_flight; ++i)
+            forget(outbound[i]);
+        outbound.erase(outbound.begin(), outbound.begin() + in_flight);
+        in_flight = 0;
+
         if (error.failed()) {
-            debug_output("Read error: " + error.message());
-            debug_output("Connection closed...");
-            alive = false;
-            expired = true;
-            return;
+            // ak este bezi citanie, skonci chybou a zavrie spojenie
+            LOG(Info, tag() + "Write error: " + error.message());
+            while (!outbound.empty()) {
+                forget(outbound.back());
+                outbound.pop_back();
+            }
+            writing = false;
+            closed = closing;
+        } else {
+            if (lagging and queued_bytes <= LOW_WATERMARK) {
+                // klient dobehol, zmeskane delty nahradi novy obraz
+                lagging = false;
+                resync = true;
+            }
+            more = !outbound.empty();
+            if (!more) {
+                writing = false;
+                closed = closing;
+            }
         }
+        mtx.unlock();
 
-        std::cout << "\n";
-        debug_output("Data received: " + rec_buff_);
+        if (more)
+            start_write();
+        if (closed)
+            shutdown("Connection closed after error");
+        else if (resync)
+            request_image();
+    }
 
-        // ak je message "DD" tak nerob nic, update sa posle pri klasickom
-        //  broadcaste
-        bool message_valid = true;
-        if (rec_buff_ != "DD")
-            message_valid
-                = Document::Document_handler::process_message(id, rec_buff_);
-        // debug vec
-        Document::Document_handler::print();
+    // Zahodi obrazy a delty, ktore este nezacal zapisovat async_write.
+    //  Volat s drzanym mtx.
+    void drop_queued_state()
+    {
+        auto is_state = [](const Outbound_entry& entry) {
+            return entry.type == Protocol::Message_type::Image
+                or entry.type == Protocol::Message_type::Delta;
+        };
+        auto kept = std::stable_partition(outbound.begin() + in_flight,
+            outbound.end(), [&is_state](const Outbound_entry& entry) {
+                return !is_state(entry);
+            });
+        for (auto it = kept; it != outbound.end(); ++it)
+            forget(*it);
+        outbound.erase(kept, outbound.end());
+    }
 
-        // broadcastni stav dokumentu
-        if (message_valid)
-            send_all(Document::Document_handler::serialize());
+    void forget(const Outbound_entry& entry)
+    {
+        if (!entry.message)
+            return;
+        queued_bytes -= entry.message->size();
+        if (entry.type == Protocol::Message_type::Delta)
+            delta_bytes -= entry.message->size();
+    }
 
-        // citaj dalsi message (rekurzivne sa loopuje)
+    void read_header()
+    {
         boost::asio::async_read(socket,
-            boost::asio::buffer(rec_buff_, DEFAULT_MESSAGE_LENGTH),
-            boost::bind(&Tcp_connection::handle_read, this,
+            boost::asio::buffer(header_buff_, Protocol::HEADER_SIZE),
+            boost::bind(&Tcp_connection::handle_read_header,
+                shared_from_this(), boost::asio::placeholders::error,
+                boost::asio::placeholders::bytes_transferred));
+    }
+
+    void handle_read_header(
+        const boost::system::error_code& error, size_t /*bytes_transferred*/)
+    {
+        if (error.failed())
+            return close("Read error: " + error.message());
+
+        // dlzka zahrna aj bajt typu, ktory uz je v hlavicke
+        uint32_t length = Protocol::frame_length(header_buff_);
+        if (length == 0 or length > Protocol::MAX_CLIENT_FRAME)
+            return send_error("Invalid frame length");
+
+        rec_buff_.resize(length - 1);
+        boost::asio::async_read(socket, boost::asio::buffer(rec_buff_),
+            boost::bind(&Tcp_connection::handle_read, shared_from_this(),
                 boost::asio::placeholders::error,
                 boost::asio::placeholders::bytes_transferred));
     }
 
-    void handle_write_empty(
+    void handle_read(
         const boost::system::error_code& error, size_t /*bytes_transferred*/)
     {
-        /*
-            Ked netreba special handling writu, typicky pri broadcaste
-        */
-        debug_output(error.message());
+        // error handling
+        if (error.failed())
+            return close("Read error: " + error.message());
+
+        auto type = Protocol::Message_type(header_buff_[Protocol::LENGTH_SIZE]);
+        try {
+            if (!handle_message(type))
+                return;
+        } catch (Protocol::Protocol_error& e) {
+            return send_error(e.what());
+        }
+
+        // citaj dalsi message (rekurzivne sa loopuje), predosly sa medzitym
+        //  aplikuje na strande dokumentu. Kym ring dokumentu nepreberie
+        //  vsetko zaradene, dalej sa necita.
+        if (backlog.empty())
+            read_header();
+        else
+            read_paused = true;
+    }
+
+    // Vrati false, ak sa uz dalej necita
+    bool handle_message(Protocol::Message_type type)
+    {
+        LOG(Debug,
+            tag() + "Message received, type " + std::to_string(int(type))
+                + ", " + std::to_string(rec_buff_.size()) + " bytes");
+
+        if (!welcomed and type != Protocol::Message_type::Hello) {
+            send_error("Expected Hello");
+            return false;
+        }
+
+        switch (type) {
+        case Protocol::Message_type::Hello: {
+            Protocol::Reader reader(
+                rec_buff_.data(), rec_buff_.data() + rec_buff_.size());
+            uint64_t version = reader.varint();
+            if (version != Protocol::VERSION) {
+                send_error("Unsupported protocol version "
+                    + std::to_string(version) + ", server speaks "
+                    + std::to_string(Protocol::VERSION));
+                return false;
+            }
+            std::string name(reader.text());
+            if (!Protocol::valid_document_name(name)
+                or Document::is_wal_file_name(name)) {
+                send_error("Invalid document name");
+                return false;
+            }
+            // vyska okna je volitelna, bez nej klient dostava cely dokument
+            if (!reader.done())
+                view_height = reader.varint();
+            document = registry.acquire(name);
+            if (!document) {
+                send_error("Server is shutting down");
+                return false;
+            }
+            welcomed = true;
+            LOG(Info, tag() + "Document " + name);
+
+            // Send id
+            std::string payload;
+            Protocol::put_varint(payload, Protocol::VERSION);
+            Protocol::put_varint(payload, id);
+            send(Protocol::Message_type::Welcome,
+                Protocol::frame(Protocol::Message_type::Welcome, payload));
+
+            // prida cursor do dokumentu, ostatni uvidia novy cursor a novy
+            //  klient dostane cely obraz
+            submit(Queued_command::Kind::Join);
+            break;
+        }
+        case Protocol::Message_type::Command: {
+            Protocol::Reader reader(
+                rec_buff_.data(), rec_buff_.data() + rec_buff_.size());
+            uint64_t sequence = reader.varint();
+            submit(Queued_command::Kind::Command, std::string(reader.rest()),
+                sequence);
+            break;
+        }
+        case Protocol::Message_type::Resync:
+            // klientovi chyba delta, dostane cely obraz
+            request_image();
+            break;
+        case Protocol::Message_type::Viewport: {
+            // sprava sa skontroluje tu, strand dokumentu ju uz iba precita
+            Protocol::Reader reader(
+                rec_buff_.data(), rec_buff_.data() + rec_buff_.size());
+            reader.varint();
+            reader.varint();
+            submit(Queued_command::Kind::Viewport, rec_buff_);
+            break;
+        }
+        default:
+            LOG(Warning, tag() + "Unknown message.");
+            break;
+        }
+        return true;
+    }
+
+    void request_image() { submit(Queued_command::Kind::Resync); }
+
+    // Zaradi prikaz za vsetky predosle od tohto klienta. Na strande
+    //  spojenia.
+    void submit(Queued_command::Kind kind, std::string message = {},
+        uint64_t sequence = 0)
+    {
+        backlog.push_back(Queued_command {
+            kind, shared_from_this(), std::move(message), sequence });
+        if (backlog.size() == 1)
+            flush_backlog();
+    }
+
+    // Kym je ring dokumentu plny, skusa to znova po SUBMIT_RETRY, klient
+    //  medzitym nic dalsie neposle, lebo sa necita
+    void flush_backlog()
+    {
+        while (!backlog.empty()) {
+            if (!document->submit(backlog.front())) {
+                retry_timer.expires_after(SUBMIT_RETRY);
+                retry_timer.async_wait(
+                    [self = shared_from_this()](
+                        const boost::system::error_code&) {
+                        self->flush_backlog();
+                    });
+                return;
+            }
+            backlog.pop_front();
+        }
+        if (read_paused) {
+            read_paused = false;
+            read_header();
+        }
+    }
+
+    // Posle Error a po jeho odoslani zavrie spojenie, dalej sa necita
+    void send_error(const std::string& message)
+    {
+        LOG(Warning, tag() + "Protocol error: " + message);
+        send(Protocol::Message_type::Error,
+            Protocol::frame(Protocol::Message_type::Error, message));
+        mtx.lock();
+        // za Error uz nic dalsie nepojde
+        alive = false;
+        closing = true;
+        bool closed = !writing;
+        mtx.unlock();
+
+        if (closed)
+            shutdown("Connection closed after error");
     }
 
-    void debug_output(const std::string& message) const
+    void shutdown(const std::string& reason)
     {
-        std::cout << "[" << id << "] " << message << "\n";
+        boost::system::error_code ignored;
+        socket.shutdown(tcp::socket::shutdown_both, ignored);
+        close(reason);
     }
 
-    std::string send_buff_, rec_buff_;
-    std::function<void(std::string)> send_all;
+    void close(const std::string& reason)
+    {
+        if (expired.exchange(true))
+            return;
+        LOG(Info, tag() + "Connection closed: " + reason);
+        alive = false;
+        // pred Hello sa k ziadnemu dokumentu nepripojil
+        if (!document)
+            return;
+        // ostatnym zmizne cursor
+        read_paused = false;
+        submit(Queued_command::Kind::Leave);
+    }
+
+    std::string tag() const { return "[" + std::to_string(id) + "] "; }
+
+    Document_registry& registry;
+    // Nastavi sa pri Hello, potom sa uz nemeni
+    std::shared_ptr<Hosted_document> document;
+    // Prikazy, ktore sa do ringu dokumentu zatial nezmestili
+    std::deque<Queued_command> backlog;
+    boost::asio::steady_timer retry_timer;
+    bool read_paused;
+    char header_buff_[Protocol::HEADER_SIZE];
+    std::string rec_buff_;
     int id;
-    bool alive;
-    bool expired;
-    static const int DEFAULT_MESSAGE_LENGTH = 2;
+    std::atomic<bool> alive;
+    std::atomic<bool> expired;
+    // Klient poslal Hello so spravnou verziou
+    bool welcomed;
+
+    // Spravy na odoslanie, prvych in_flight prave zapisuje async_write
+    std::deque<Outbound_entry> outbound;
+    bool writing;
+    // Po odoslani fronty sa socket zavrie
+    bool closing;
+    size_t in_flight;
+    // Bajty vo fronte, vratane prave zapisovanych
+    size_t queued_bytes;
+    // Iba delty, obrazy sa zlucuju, takze frontu nenafuknu
+    size_t delta_bytes;
+    // Delty sa zahadzuju, kym fronta neklesne pod LOW_WATERMARK
+    bool lagging;
+    // Zaciatok aktualneho zapisu
+    std::chrono::steady_clock::time_point last_progress;
 
+    static constexpr std::chrono::milliseconds SUBMIT_RETRY
+        = std::chrono::milliseconds(1);
+    static const size_t HIGH_WATERMARK = 1 << 20;
+    static const size_t LOW_WATERMARK = 256 << 10;
+    // Zaostavajuci klient, ktory takto dlho nic neprecital, sa odpoji
+    static constexpr std::chrono::seconds STUCK_TIMEOUT
+        = std::chrono::seconds(30);
+
+    // Chrani frontu, plni ju strand dokumentu a vyprazdnuje strand spojenia
     std::mutex mtx;
 };
 
+bool Hosted_document::submit(Queued_command& command)
+{
+    if (!commands.push(command))
+        return false;
+    // zapis do ringu musi byt viditelny skor, ako drain zisti, ze nie je
+    //  naplanovany, inak by prikaz v ringu ostal
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (!draining.exchange(true))
+        boost::asio::post(
+            strand, [self = shared_from_this()]() { self->drain(); });
+    return true;
+}
+
+void Hosted_document::drain()
+{
+    Queued_command command;
+    for (size_t i = 0; i < DRAIN_BATCH;) {
+        if (commands.pop(command)) {
+            apply(command);
+            command = Queued_command();
+            ++i;
+            continue;
+        }
+        draining = false;
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        // prikaz mohol prist medzi pop a vynulovanim, jeho odosielatel
+        //  videl draining este nastaveny
+        if (commands.empty() or draining.exchange(true))
+            return;
+    }
+    // plny ring sa spracuje na viac krat, medzitym pobezi tick timer
+    boost::asio::post(strand, [self = shared_from_this()]() { self->drain(); });
+}
+
+void Hosted_document::apply(Queued_command& command)
+{
+    const Tcp_connection::pointer& connection = command.connection;
+    int id = connection->get_id();
+    if ((closed or !loaded) and command.kind != Queued_command::Kind::Leave) {
+        // dokument sa pri ukonceni uz ulozil alebo sa nenacital, zmena by
+        //  sa nikam neulozila
+        if (command.kind == Queued_command::Kind::Join)
+            connection->refuse(
+                closed ? "Server is shutting down" : "Cannot open document");
+        return;
+    }
+    switch (command.kind) {
+    case Queued_command::Kind::Join:
+        handler.add_new_cursor(id);
+        connections[id] = connection;
+        broadcast_changes();
+        connection->send_image(image_for(*connection));
+        break;
+    case Queued_command::Kind::Command:
+        // aj neplatny prikaz sa potvrdi, klient ho prestane predpovedat
+        handler.process_message(id, command.message);
+        handler.acknowledge(id, command.sequence);
+        schedule_broadcast();
+        LOG(Dump, handler.dump());
+        break;
+    case Queued_command::Kind::Resync:
+        // obraz nadvazuje na poslednu deltu, neodoslane operacie idu
+        //  najprv vsetkym
+        broadcast_changes();
+        connection->send_image(image_for(*connection));
+        break;
+    case Queued_command::Kind::Viewport: {
+        Protocol::Reader reader(command.message.data(),
+            command.message.data() + command.message.size());
+        connection->view_first = reader.varint();
+        connection->view_height = reader.varint();
+        broadcast_changes();
+        connection->send_image(image_for(*connection));
+        break;
+    }
+    case Queued_command::Kind::Leave:
+        handler.remove_cursor(id);
+        connections.erase(id);
+        broadcast_changes();
+        connection->left();
+        break;
+    }
+}
+
+void Hosted_document::schedule_broadcast()
+{
+    ++batched;
+    if (tick_armed)
+        return;
+    auto now = std::chrono::steady_clock::now();
+    if (now - last_broadcast >= tick)
+        return broadcast_changes();
+
+    tick_armed = true;
+    tick_timer.expires_at(last_broadcast + tick);
+    tick_timer.async_wait(
+        [self = shared_from_this()](const boost::system::error_code&) {
+            self->tick_armed = false;
+            self->broadcast_changes();
+        });
+}
+
+void Hosted_document::broadcast_changes()
+{
+    Document::Delta delta = handler.take_delta();
+    if (delta.operations.empty())
+        return;
+    last_broadcast = std::chrono::steady_clock::now();
+    ++broadcast_stats.broadcasts;
+    broadcast_stats.commands += batched;
+    broadcast_stats.max_batch = std::max(broadcast_stats.max_batch, batched);
+    batched = 0;
+
+    // zakoduje sa raz, vsetky spojenia zdielaju ten isty buffer
+    std::string frame;
+    size_t frame_begin
+        = Protocol::begin_frame(frame, Protocol::Message_type::Delta);
+    delta.encode(frame);
+    Protocol::end_frame(frame, frame_begin);
+    Outbound_message message
+        = std::make_shared<const Protocol::Chunked_message>(std::move(frame));
+
+    Document::Durability durability = wal.durability();
+    if (!log or durability == Document::Durability::None)
+        send_delta(message);
+    else if (durability == Document::Durability::Strict) {
+        // klienti uvidia deltu az po fsync-e, v poradi verzii; obraz pre
+        //  noveho klienta ju moze obsahovat uz skor
+        logged += wal.append(
+            log, delta, [self = shared_from_this(), message]() {
+                boost::asio::post(self->strand,
+                    [self, message]() { self->send_delta(message); });
+            });
+    } else {
+        logged += wal.append(log, delta);
+        send_delta(message);
+    }
+
+    if (logged >= SNAPSHOT_LOG_BYTES and !snapshotting)
+        snapshot([](bool) {});
+}
+
+void Hosted_document::send_delta(const Outbound_message& message)
+{
+    for (auto&& connection : connections)
+        connection.second->send(Protocol::Message_type::Delta, message);
+}
+
+Document::Document_image Hosted_document::image_for(
+    const Tcp_connection& connection) const
+{
+    size_t height = std::min(connection.view_height, MAX_VIEW_HEIGHT);
+    if (height == 0)
+        return handler.get_document_image();
+    size_t margin = PREFETCH_PAGES * height;
+    size_t first = connection.view_first;
+    size_t start = first > margin ? first - margin : 0;
+    return handler.get_document_image(start, first - start + height + margin);
+}
+
+void Hosted_document::load()
+{
+    using std::chrono::duration_cast;
+    using std::chrono::milliseconds;
+    try {
+        auto start = std::chrono::steady_clock::now();
+        Document::Wal::finish_snapshot(path);
+        bool exists = std::filesystem::exists(path);
+        if (exists)
+            handler.open(path);
+        auto opened = std::chrono::steady_clock::now();
+        Document::Wal_replay replay = Document::Wal::replay(path,
+            [this](const Document::Delta& delta) { handler.replay(delta); });
+        handler.set_version(replay.version);
+        log = wal.open(path, replay.version);
+        logged = replay.bytes;
+        loaded = true;
+
+        auto end = std::chrono::steady_clock::now();
+        if (exists or replay.deltas != 0)
+            LOG(Info,
+                "Opened " + path + " in "
+                    + std::to_string(
+                        duration_cast<milliseconds>(end - start).count())
+                    + " ms: " + std::to_string(handler.stats().lines)
+                    + " lines in "
+                    + std::to_string(
+                        duration_cast<milliseconds>(opened - start).count())
+                    + " ms, " + std::to_string(replay.deltas)
+                    + " deltas (" + std::to_string(replay.bytes)
+                    + " bytes) from log in "
+                    + std::to_string(
+                        duration_cast<milliseconds>(end - opened).count())
+                    + " ms");
+    } catch (std::exception& e) {
+        LOG(Error, "Cannot open " + path + ": " + e.what());
+        return;
+    }
+    // dlhy zvysok logu skrati snapshot, dalsi start ho uz nebude opakovat
+    if (logged >= SNAPSHOT_LOG_BYTES)
+        snapshot([](bool) {});
+}
+
+void Hosted_document::snapshot(std::function<void(bool)> done)
+{
+    if (!loaded or !log)
+        return done(false);
+    if (snapshotting) {
+        // napr. ukoncenie pocas snapshotu pri vyradeni, log este drzi
+        //  rotacia, novy snapshot zacne az po nej
+        waiting.push_back(std::move(done));
+        return;
+    }
+    // vsetky operacie do logu, verzia snapshotu je verzia poslednej delty
+    broadcast_changes();
+    snapshotting = true;
+    logged = 0;
+
+    auto finish = [self = shared_from_this(), done](bool ok) {
+        boost::asio::post(self->strand, [self, done, ok]() {
+            self->snapshotting = false;
+            if (ok)
+                LOG(Info, "Saved " + self->path);
+            done(ok);
+            if (self->waiting.empty())
+                return;
+            // jeden dalsi snapshot pre vsetkych, co cakali
+            auto waiting = std::move(self->waiting);
+            self->waiting.clear();
+            self->snapshot([waiting](bool ok) {
+                for (auto&& done : waiting)
+                    done(ok);
+            });
+        });
+    };
+    // po rotacii sa snapshot zapisuje na vlakne poolu, nie na strande
+    auto save = [self = shared_from_this(), log = log,
+                    lines = handler.snapshot(), finish]() {
+        try {
+            lines->save(self->path + ".snapshot");
+        } catch (std::exception& e) {
+            LOG(Error, "Cannot save " + self->path + ": " + e.what());
+            return finish(false);
+        }
+        self->wal.commit(log, finish);
+    };
+    wal.rotate(log, handler.get_version(),
+        [executor = strand.get_inner_executor(), save, finish](bool ok) {
+            if (ok)
+                boost::asio::post(executor, save);
+            else
+                finish(false);
+        });
+}
+
+void Hosted_document::close_log()
+{
+    if (!log)
+        return;
+    wal.close(log);
+    log.reset();
+}
+
+void Hosted_document::reopen_log()
+{
+    if (loaded and !log)
+        log = wal.open(path, handler.get_version());
+}
+
+void Hosted_document::shutdown(std::function<void()> done)
+{
+    closed = true;
+    snapshot([self = shared_from_this(), done](bool) {
+        self->close_log();
+        done();
+    });
+}
+
+Broadcast_stats Hosted_document::take_broadcast_stats()
+{
+    Broadcast_stats stats = broadcast_stats;
+    broadcast_stats = Broadcast_stats { 0, 0, 0 };
+    return stats;
+}
+
 class Tcp_server {
 public:
-    Tcp_server(boost::asio::io_context& io_context, size_t port)
+    Tcp_server(boost::asio::io_context& io_context, size_t port,
+        Document_registry& registry)
         : io_context_(io_context)
         , acceptor_(io_context, tcp::endpoint(tcp::v4(), port))
+        , registry(registry)
+        , stats_timer(io_context)
+        , evict_timer(io_context)
         , next_client_id(0)
     {
         start_accept();
+        start_stats_timer();
+        start_evict_timer();
     }
 
     Tcp_server& operator=(const Tcp_server&) = delete; // nekopirovatelne
 
-    void send_all(const std::string& message)
-    {
-        auto it = connections.begin();
-        while (it != connections.end()) {
-            if (it->second->is_expired()) {
-                connections.erase(it++);
-            } else {
-                it->second->send(message);
-                ++it;
-            }
-        }
-    }
-
 private:
     void start_accept()
     {
-        std::cout << "Start accept\n";
+        LOG(Debug, "Start accept");
 
-        // Tcp_connection::pointer new_connection = Tcp_connection::create(
-        //     io_context_, dh,
-        //     [myself](std::string message) { myself->send_all(message); },
-        //     next_client_id);
-        connections[next_client_id] = Tcp_connection::create(
-            io_context_,
-            [this](const std::string& message) { this->send_all(message); },
-            next_client_id);
+        Tcp_connection::pointer new_connection
+            = Tcp_connection::create(io_context_, registry, next_client_id);
+        ++next_client_id;
+
+        acceptor_.async_accept(new_connection->socket,
+            boost::bind(&Tcp_server::handle_accept, this, new_connection,
+                boost::asio::placeholders::error));
+    }
 
-        Tcp_connection& new_connection_ref = *connections[next_client_id];
+    void start_stats_timer()
+    {
+        stats_timer.expires_after(STATS_INTERVAL);
+        stats_timer.async_wait([this](const boost::system::error_code& error) {
+            if (error)
+                return;
+            LOG(Info, "Documents: " + std::to_string(registry.size()));
+            // stav dokumentu sa smie citat iba na jeho strande
+            registry.for_each(print_stats);
+            start_stats_timer();
+        });
+    }
 
-        // std::unique_ptr<Tcp_connection> up = std::move(new_connection);
-        // connections[next_client_id]
-        //     = std::make_unique<Tcp_connection>(*new_connection);
-        std::cout << "Number of connections: " << connections.size() << "\n";
+    void start_evict_timer()
+    {
+        evict_timer.expires_after(EVICT_INTERVAL);
+        evict_timer.async_wait([this](const boost::system::error_code& error) {
+            if (error)
+                return;
+            registry.evict_idle();
+            start_evict_timer();
+        });
+    }
 
-        ++next_client_id;
+    static void print_stats(Hosted_document& document)
+    {
+        Document::Document_stats stats = document.handler.stats();
+        std::ostringstream out;
+        out << "Document " << document.name << " ("
+            << Document::storage_type_name(stats.type) << "): " << stats.lines
+            << " lines, " << stats.memory << " bytes (" << stats.undo
+            << " undo), "
+            << document.connections.size() << " clients";
+        Broadcast_stats broadcast = document.take_broadcast_stats();
+        if (broadcast.broadcasts != 0)
+            out << ", " << broadcast.commands << " commands in "
+                << broadcast.broadcasts << " broadcasts, "
+                << double(broadcast.commands) / broadcast.broadcasts
+                << " per broadcast, max " << broadcast.max_batch;
+        LOG(Info, out.str());
 
-        acceptor_.async_accept(new_connection_ref.socket,
-            boost::bind(&Tcp_server::handle_accept, this,
-                boost::ref(new_connection_ref),
-                boost::asio::placeholders::error));
+        for (auto&& connection : document.connections) {
+            if (!connection.second->is_alive())
+                continue;
+            Tcp_connection::Queue_stats queue
+                = connection.second->queue_stats();
+            LOG(Debug,
+                "[" + std::to_string(connection.first)
+                    + "] queue: " + std::to_string(queue.messages)
+                    + " messages, " + std::to_string(queue.bytes) + " bytes"
+                    + (queue.lagging ? ", lagging" : ""));
+        }
     }
 
-    void handle_accept(
-        Tcp_connection& new_connection, const boost::system::error_code& error)
+    void handle_accept(Tcp_connection::pointer new_connection,
+        const boost::system::error_code& error)
     {
         if (!error) {
-            new_connection.start();
+            // handlery spojenia bezia na jeho strande
+            boost::asio::post(new_connection->socket.get_executor(),
+                boost::bind(&Tcp_connection::start, new_connection));
         }
 
         start_accept();
@@ -214,21 +1322,196 @@ private:
 
     boost::asio::io_context& io_context_;
     tcp::acceptor acceptor_;
+    Document_registry& registry;
+    boost::asio::steady_timer stats_timer;
+    boost::asio::steady_timer evict_timer;
     int next_client_id;
-
-    std::map<int, std::unique_ptr<Tcp_connection>> connections;
+    static constexpr std::chrono::seconds STATS_INTERVAL
+        = std::chrono::seconds(10);
+    static constexpr std::chrono::seconds EVICT_INTERVAL
+        = std::chrono::seconds(5);
 };
 
-int main()
+void print_usage()
+{
+    std::cerr << "Usage: server [--storage rope|vector|arena] [--data <dir>]"
+                 " [--threads <count>] [--shards <count>]"
+                 " [--idle <seconds>] [--tick <ms>]"
+                 " [--log dump|debug|info|warning|error|off]"
+                 " [--durability none|async|batch|strict] [--fsync <ms>]"
+                 " [--bench-wal <records>]"
+              << std::endl;
+}
+
+// Priepustnost logu pre kazdu uroven: BENCH_DOCUMENTS dokumentov naraz
+//  pise po jednom znaku, meria sa cas, kym su vsetky delty potvrdene
+void bench_wal(const std::string& data_dir, size_t records,
+    std::chrono::milliseconds interval)
+{
+    const size_t BENCH_DOCUMENTS = 16;
+    size_t per_document = std::max<size_t>(1, records / BENCH_DOCUMENTS);
+    for (auto durability : { Document::Durability::Async,
+             Document::Durability::Batch, Document::Durability::Strict }) {
+        Document::Wal wal(durability, interval);
+        wal.start();
+        std::vector<std::string> paths;
+        std::vector<std::shared_ptr<Document::Wal_log>> logs;
+        for (size_t i = 0; i < BENCH_DOCUMENTS; ++i) {
+            paths.push_back(data_dir + "/.bench-wal-" + std::to_string(i));
+            std::filesystem::remove(paths.back() + ".wal");
+            logs.push_back(wal.open(paths.back(), 0));
+        }
+
+        std::atomic<size_t> confirmed(0);
+        auto start = std::chrono::steady_clock::now();
+        std::vector<std::thread> writers;
+        for (auto&& log : logs)
+            writers.emplace_back([&wal, &confirmed, log, per_document]() {
+                for (size_t i = 0; i < per_document; ++i) {
+                    Document::Delta delta;
+                    delta.version = i + 1;
+                    delta.operations.push_back(
+                        Document::Operation::insert_char(0, i, 'x'));
+                    wal.append(log, delta, [&confirmed]() { ++confirmed; });
+                }
+            });
+        for (auto&& writer : writers)
+            writer.join();
+        while (confirmed < per_document * logs.size())
+            std::this_thread::sleep_for(std::chrono::microseconds(100));
+        std::chrono::duration<double> elapsed
+            = std::chrono::steady_clock::now() - start;
+        Document::Wal_stats stats = wal.stats();
+
+        for (auto&& log : logs)
+            wal.close(log);
+        wal.stop();
+        for (auto&& path : paths)
+            std::filesystem::remove(path + ".wal");
+
+        std::cout << Document::durability_name(durability) << ": "
+                  << size_t(stats.records / elapsed.count())
+                  << " deltas/s, " << stats.syncs << " fsyncs, "
+                  << (stats.syncs ? stats.records / stats.syncs : 0)
+                  << " deltas per fsync" << std::endl;
+    }
+}
+
+int main(int argc, char* argv[])
 {
     try {
-        boost::asio::io_context io_context;
-        Tcp_server server(io_context, 6969);
+        Document::Storage_type storage_type = Document::Storage_type::Rope;
+        std::string data_dir = ".";
+        size_t threads_count
+            = std::max(1u, std::thread::hardware_concurrency());
+        size_t shards_count = 64;
+        std::chrono::seconds idle_timeout(60);
+        std::chrono::milliseconds tick(10);
+        Document::Log::Level log_level = Document::Log::Level::Info;
+        Document::Durability durability = Document::Durability::Batch;
+        std::chrono::milliseconds fsync_interval(10);
+        size_t bench_records = 0;
+        for (int i = 1; i < argc; ++i) {
+            std::string arg = argv[i];
+            if (i + 1 == argc) {
+                print_usage();
+                return 1;
+            }
+            if (arg == "--storage") {
+                if (!Document::parse_storage_type(argv[++i], storage_type)) {
+                    std::cerr << "Unknown storage " << argv[i] << "\n";
+                    return 1;
+                }
+            } else if (arg == "--data")
+                data_dir = argv[++i];
+            else if (arg == "--threads" or arg == "--shards") {
+                size_t count = std::stoul(argv[++i]);
+                if (count == 0) {
+                    print_usage();
+                    return 1;
+                }
+                (arg == "--threads" ? threads_count : shards_count) = count;
+            } else if (arg == "--idle")
+                idle_timeout = std::chrono::seconds(std::stoul(argv[++i]));
+            else if (arg == "--tick")
+                tick = std::chrono::milliseconds(std::stoul(argv[++i]));
+            else if (arg == "--log") {
+                if (!Document::Log::parse_level(argv[++i], log_level)) {
+                    std::cerr << "Unknown log level " << argv[i] << "\n";
+                    return 1;
+                }
+                if (!Document::Log::compiled(log_level))
+                    std::cerr << "Log level " << argv[i]
+                              << " is not compiled in\n";
+            } else if (arg == "--durability") {
+                if (!Document::parse_durability(argv[++i], durability)) {
+                    std::cerr << "Unknown durability " << argv[i] << "\n";
+                    return 1;
+                }
+            } else if (arg == "--fsync")
+                fsync_interval
+                    = std::chrono::milliseconds(std::stoul(argv[++i]));
+            else if (arg == "--bench-wal")
+                bench_records = std::stoul(argv[++i]);
+            else {
+                print_usage();
+                return 1;
+            }
+        }
+
+        Document::Log::set_level(log_level);
+        Document::Log::start();
+
+        std::filesystem::create_directories(data_dir);
+        if (bench_records != 0) {
+            bench_wal(data_dir, bench_records, fsync_interval);
+            Document::Log::stop();
+            return 0;
+        }
+        // docasne subory ukladania, ktore nedokoncil predosly beh
+        Document::remove_temporary_files(data_dir);
+        LOG(Info,
+            std::string("Storage: ")
+                + Document::storage_type_name(storage_type)
+                + ", data: " + data_dir + ", durability: "
+                + Document::durability_name(durability));
+
+        // log sa zastavi az po vlaknach servera, posledne snapshoty ho
+        //  este potrebuju
+        Document::Wal wal(durability, fsync_interval);
+        wal.start();
+        boost::asio::io_context io_context(threads_count);
+        Document_registry registry(io_context, wal, storage_type, data_dir,
+            shards_count, idle_timeout, tick);
+        Tcp_server server(io_context, 6969, registry);
+        // server uz pocuva, obnova bezi na vlaknach poolu
+        registry.preload();
+
+        // pri ukonceni ulozime otvorene dokumenty, kazdy na jeho strande,
+        //  aby sa neukladal uprostred editu
+        boost::asio::signal_set signals(io_context, SIGINT, SIGTERM);
+        signals.async_wait(
+            [&io_context, &registry](const boost::system::error_code& error,
+                int) {
+                if (error)
+                    return io_context.stop();
+                registry.save_all([&io_context]() { io_context.stop(); });
+            });
 
+        LOG(Info, "Threads: " + std::to_string(threads_count));
+        std::vector<std::thread> threads;
+        for (size_t i = 1; i < threads_count; ++i)
+            threads.emplace_back([&io_context]() { io_context.run(); });
         io_context.run();
+        for (auto&& thread : threads)
+            thread.join();
     } catch (std::exception& e) {
+        // chyba moze prist aj pred Log::start, log by ju nevypisal
         std::cerr << e.what() << std::endl;
+        Document::Log::stop();
+        return 1;
     }
 
+    Document::Log::stop();
     return 0;
-}
\ No newline at end of file
+}
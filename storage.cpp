@@ -0,0 +1,190 @@
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "arena.h"
+#include "file.h"
+#include "rope.h"
+#include "storage.h"
+
+namespace Document {
+
+void Storage::load(std::shared_ptr<const Line_source> source)
+{
+    // cerstve ulozisko ma jeden prazdny riadok, ten na konci zmazeme
+    for (size_t i = 0; i < source->lines_count(); ++i)
+        insert_line(i, std::string(source->line(i)));
+    delete_line(lines_count() - 1);
+}
+
+void Storage::replace_lines(
+    size_t line, size_t count, const std::vector<std::string>& content)
+{
+    for (size_t i = 0; i < count; ++i)
+        delete_line(line);
+    for (size_t i = 0; i < content.size(); ++i)
+        insert_line(line + i, content[i]);
+}
+
+std::unique_ptr<Storage> Storage::copy() const
+{
+    auto result = std::make_unique<Vector_storage>();
+    size_t line = 0;
+    for_each_line([&result, &line](const Line_view& content) {
+        result->insert_line(line++, content.str());
+    });
+    result->delete_line(line);
+    return result;
+}
+
+void Storage::encode_lines(Protocol::Chunked_message& out) const
+{
+    std::string chunk;
+    for_each_line([&chunk](const Line_view& line) {
+        Protocol::put_varint(chunk, line.length());
+        line.append_to(chunk);
+    });
+    out.append(std::move(chunk));
+}
+
+std::shared_ptr<const Storage> Storage::snapshot() const { return copy(); }
+
+void Storage::save(const std::string& path) const
+{
+    // riadky sa zapisuju postupne, cely dokument sa nikdy neposklada
+    Atomic_file_writer writer(path);
+    bool first_line = true;
+    for_each_line([&writer, &first_line](const Line_view& line) {
+        if (!first_line)
+            writer.write("\n");
+        first_line = false;
+        writer.write(line.head);
+        writer.write(line.tail);
+    });
+    writer.commit();
+}
+
+Vector_storage::Vector_storage()
+    : data(std::vector<std::string>(1))
+{
+}
+
+size_t Vector_storage::lines_count() const { return data.size(); }
+
+size_t Vector_storage::line_length(size_t line) const
+{
+    return data[line].length();
+}
+
+std::string Vector_storage::line(size_t line) const { return data[line]; }
+
+void Vector_storage::for_each_line(
+    const std::function<void(const Line_view&)>& f) const
+{
+    for (auto&& line : data)
+        f(Line_view(line));
+}
+
+size_t Vector_storage::memory_usage() const
+{
+    size_t usage = sizeof(*this) + data.capacity() * sizeof(std::string);
+    for (auto&& line : data)
+        // kratke riadky su v small string buffri, bez alokacie
+        if (line.capacity() > std::string().capacity())
+            usage += line.capacity() + 1;
+    return usage;
+}
+
+std::unique_ptr<Storage> Vector_storage::copy() const
+{
+    return std::make_unique<Vector_storage>(*this);
+}
+
+void Vector_storage::insert_line(size_t line, const std::string& content)
+{
+    data.insert(data.begin() + line, content);
+}
+
+void Vector_storage::delete_line(size_t line)
+{
+    data.erase(data.begin() + line);
+}
+
+void Vector_storage::break_line(size_t line, size_t column)
+{
+    std::string new_line = data[line].substr(column);
+    data.insert(data.begin() + line + 1, new_line);
+    data[line].resize(column);
+}
+
+void Vector_storage::join_lines(size_t line)
+{
+    std::string next_line_content = std::move(data[line + 1]);
+    data.erase(data.begin() + line + 1);
+    data[line] += next_line_content;
+}
+
+void Vector_storage::insert_char(size_t line, size_t column, char ch)
+{
+    data[line].insert(data[line].begin() + column, 1, ch);
+}
+
+void Vector_storage::delete_char(size_t line, size_t column)
+{
+    data[line].erase(column, 1);
+}
+
+void Vector_storage::replace_lines(
+    size_t line, size_t count, const std::vector<std::string>& content)
+{
+    // prepise spolocnu cast a zvysok vlozi alebo zmaze jednym posunom
+    size_t common = std::min(count, content.size());
+    std::copy(content.begin(), content.begin() + common, data.begin() + line);
+    if (count > common)
+        data.erase(data.begin() + line + common, data.begin() + line + count);
+    else
+        data.insert(data.begin() + line + common, content.begin() + common,
+            content.end());
+}
+
+std::unique_ptr<Storage> make_storage(Storage_type type)
+{
+    switch (type) {
+    case Storage_type::Vector:
+        return std::make_unique<Vector_storage>();
+    case Storage_type::Rope:
+        return std::make_unique<Rope_storage>();
+    case Storage_type::Arena:
+        return std::make_unique<Arena_storage>();
+    }
+    return nullptr;
+}
+
+bool parse_storage_type(const std::string& name, Storage_type& type)
+{
+    if (name == "vector")
+        type = Storage_type::Vector;
+    else if (name == "rope")
+        type = Storage_type::Rope;
+    else if (name == "arena")
+        type = Storage_type::Arena;
+    else
+        return false;
+    return true;
+}
+
+const char* storage_type_name(Storage_type type)
+{
+    switch (type) {
+    case Storage_type::Vector:
+        return "vector";
+    case Storage_type::Rope:
+        return "rope";
+    case Storage_type::Arena:
+        return "arena";
+    }
+    return "unknown";
+}
+
+}
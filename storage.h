@@ -0,0 +1,93 @@
+#ifndef M_STORAGE
+#define M_STORAGE
+
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "line.h"
+#include "protocol.h"
+
+namespace Document {
+
+enum class Storage_type { Vector, Rope, Arena };
+
+// Ulozisko riadkov dokumentu. Document cez neho robi vsetky upravy, takze
+//  backend sa da vymenit bez zasahu do Cursor-a.
+class Storage {
+public:
+    virtual ~Storage() = default;
+
+    // Storage info
+    virtual size_t lines_count() const = 0;
+    virtual size_t line_length(size_t line) const = 0;
+    virtual std::string line(size_t line) const = 0;
+    virtual void for_each_line(
+        const std::function<void(const Line_view&)>& f) const
+        = 0;
+    // Riadky v tvare Document_image (varint dlzka a bajty). Predvolene sa
+    //  vsetky zakoduju nanovo do jedneho kusu, backend si moze kusy
+    //  cachovat a pri uprave zahodit iba zmenene.
+    virtual void encode_lines(Protocol::Chunked_message& out) const;
+    // Odhad pamate v bajtoch, bez reziie alokatora
+    virtual size_t memory_usage() const = 0;
+    // Nezavisla kopia obsahu. Predvolene sa riadky skopiruju, O(lines).
+    virtual std::unique_ptr<Storage> copy() const;
+    // Nemenna kopia obsahu, rovnako draha ako copy()
+    std::shared_ptr<const Storage> snapshot() const;
+    // Atomicky zapise riadky do suboru
+    void save(const std::string& path) const;
+
+    // Nahradi obsah riadkami zo suboru, volat iba na cerstvom ulozisku.
+    //  Predvolene riadky skopiruje, backend si moze zdroj ponechat.
+    virtual void load(std::shared_ptr<const Line_source> source);
+
+    // Storage modification, indexy su uz skontrolovane Document-om
+    virtual void insert_line(size_t line, const std::string& content) = 0;
+    virtual void delete_line(size_t line) = 0;
+    virtual void break_line(size_t line, size_t column) = 0;
+    // Prilepi riadok line + 1 na koniec riadku line
+    virtual void join_lines(size_t line) = 0;
+    virtual void insert_char(size_t line, size_t column, char ch) = 0;
+    virtual void delete_char(size_t line, size_t column) = 0;
+    // Nahradi count riadkov od line riadkami content, vlozenie aj mazanie
+    //  celeho bloku naraz. Predvolene po riadkoch cez delete_line a
+    //  insert_line.
+    virtual void replace_lines(
+        size_t line, size_t count, const std::vector<std::string>& content);
+};
+
+// Povodny layout, vsetky riadkove operacie su O(lines)
+class Vector_storage : public Storage {
+public:
+    Vector_storage();
+
+    size_t lines_count() const override;
+    size_t line_length(size_t line) const override;
+    std::string line(size_t line) const override;
+    void for_each_line(
+        const std::function<void(const Line_view&)>& f) const override;
+    size_t memory_usage() const override;
+    std::unique_ptr<Storage> copy() const override;
+
+    void insert_line(size_t line, const std::string& content) override;
+    void delete_line(size_t line) override;
+    void break_line(size_t line, size_t column) override;
+    void join_lines(size_t line) override;
+    void insert_char(size_t line, size_t column, char ch) override;
+    void delete_char(size_t line, size_t column) override;
+    void replace_lines(size_t line, size_t count,
+        const std::vector<std::string>& content) override;
+
+private:
+    std::vector<std::string> data;
+};
+
+std::unique_ptr<Storage> make_storage(Storage_type type);
+bool parse_storage_type(const std::string& name, Storage_type& type);
+const char* storage_type_name(Storage_type type);
+
+}
+
+#endif
@@ -0,0 +1,332 @@
+#include <algorithm>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#include "file.h"
+#include "storage.h"
+
+// Vsetky backendy Storage porovnava s obycajnym vektorom riadkov. Nahodne
+//  upravy idu aj do kopii z copy(), ktore zdielaju bloky a uzly s povodnym
+//  uloziskom, takze sa overi aj copy-on-write v oboch smeroch.
+
+namespace {
+
+using Document::Storage;
+using Document::Storage_type;
+using Lines = std::vector<std::string>;
+
+int failures = 0;
+
+void check(bool ok, const std::string& what)
+{
+    if (ok)
+        return;
+    std::cerr << "FAIL: " << what << std::endl;
+    ++failures;
+}
+
+struct Replica {
+    std::unique_ptr<Storage> storage;
+    Lines model;
+};
+
+std::string encoded(const Lines& lines)
+{
+    std::string out;
+    for (auto&& line : lines) {
+        Document::Protocol::put_varint(out, line.size());
+        out += line;
+    }
+    return out;
+}
+
+void verify(const Replica& replica, const std::string& what)
+{
+    const Storage& storage = *replica.storage;
+    const Lines& model = replica.model;
+    if (storage.lines_count() != model.size()) {
+        check(false,
+            what + ": " + std::to_string(storage.lines_count())
+                + " lines, expected " + std::to_string(model.size()));
+        return;
+    }
+    for (size_t i = 0; i < model.size(); ++i) {
+        check(storage.line(i) == model[i],
+            what + ": line " + std::to_string(i) + " differs");
+        check(storage.line_length(i) == model[i].size(),
+            what + ": length of line " + std::to_string(i) + " differs");
+    }
+
+    size_t index = 0;
+    bool same = true;
+    storage.for_each_line([&](const Document::Line_view& line) {
+        same = same and index < model.size() and line.str() == model[index];
+        ++index;
+    });
+    check(same and index == model.size(), what + ": for_each_line differs");
+
+    Document::Protocol::Chunked_message message;
+    storage.encode_lines(message);
+    std::string bytes;
+    for (auto&& chunk : message.chunks())
+        bytes += *chunk;
+    check(bytes == encoded(model), what + ": encode_lines differs");
+}
+
+std::string random_text(std::mt19937& random, size_t max_length)
+{
+    static const std::string alphabet = "abcdefghij ";
+    std::string text(random() % (max_length + 1), ' ');
+    for (auto&& ch : text)
+        ch = alphabet[random() % alphabet.size()];
+    return text;
+}
+
+// Upravy su vacsinou blizko focus, ako pri pisani, aby sa ten isty kus
+//  suboru rezal opakovane
+void edit(Replica& replica, std::mt19937& random, size_t focus)
+{
+    Storage& storage = *replica.storage;
+    Lines& model = replica.model;
+    size_t line = random() % 4 == 0
+        ? random() % model.size()
+        : std::min(model.size() - 1, focus + random() % 8);
+    size_t length = model[line].size();
+
+    switch (random() % 8) {
+    case 0: {
+        std::string text = random_text(random, 20);
+        storage.insert_line(line, text);
+        model.insert(model.begin() + line, text);
+        break;
+    }
+    case 1:
+        if (model.size() > 1) {
+            storage.delete_line(line);
+            model.erase(model.begin() + line);
+        }
+        break;
+    case 2: {
+        size_t column = random() % (length + 1);
+        storage.break_line(line, column);
+        model.insert(model.begin() + line + 1, model[line].substr(column));
+        model[line].resize(column);
+        break;
+    }
+    case 3:
+        if (line + 1 < model.size()) {
+            storage.join_lines(line);
+            model[line] += model[line + 1];
+            model.erase(model.begin() + line + 1);
+        }
+        break;
+    case 4:
+    case 5: {
+        size_t column = random() % (length + 1);
+        char ch = 'A' + random() % 26;
+        storage.insert_char(line, column, ch);
+        model[line].insert(model[line].begin() + column, ch);
+        break;
+    }
+    case 6:
+        if (length > 0) {
+            size_t column = random() % length;
+            storage.delete_char(line, column);
+            model[line].erase(column, 1);
+        }
+        break;
+    case 7: {
+        size_t count = random() % std::min<size_t>(model.size() - line, 5);
+        Lines content(random() % 4);
+        for (auto&& text : content)
+            text = random_text(random, 20);
+        if (model.size() - count + content.size() == 0)
+            break;
+        storage.replace_lines(line, count, content);
+        model.erase(model.begin() + line, model.begin() + line + count);
+        model.insert(model.begin() + line, content.begin(), content.end());
+        break;
+    }
+    }
+}
+
+void fuzz(Storage_type type, const std::string& path, const Lines& initial)
+{
+    std::string name = Document::storage_type_name(type);
+    std::mt19937 random(12345);
+
+    std::vector<Replica> replicas(1);
+    replicas[0].storage = Document::make_storage(type);
+    replicas[0].storage->load(std::make_shared<Document::Line_index>(
+        std::make_shared<Document::Mapped_file>(path)));
+    replicas[0].model = initial;
+    verify(replicas[0], name + " load");
+
+    size_t focus = 0;
+    for (int step = 0; step < 20000 and failures == 0; ++step) {
+        if (random() % 500 == 0)
+            focus = random() % replicas[0].model.size();
+        focus = std::min(focus + random() % 2, initial.size() - 1);
+
+        if (random() % 200 == 0) {
+            // kopia zo zdielanymi datami, dalej sa upravuju obe
+            const Replica& source = replicas[random() % replicas.size()];
+            Replica copy { source.storage->copy(), source.model };
+            if (replicas.size() == 4)
+                replicas.erase(replicas.begin() + random() % 4);
+            replicas.push_back(std::move(copy));
+        }
+        Replica& replica = replicas[random() % replicas.size()];
+        edit(replica, random, focus);
+
+        if (step % 1000 == 0)
+            for (size_t i = 0; i < replicas.size(); ++i)
+                verify(replicas[i],
+                    name + " replica " + std::to_string(i) + " step "
+                        + std::to_string(step));
+    }
+    for (size_t i = 0; i < replicas.size(); ++i)
+        verify(replicas[i], name + " replica " + std::to_string(i));
+
+    // snapshot sa nesmie zmenit, ked sa povodne ulozisko dalej upravuje
+    Replica& last = replicas.back();
+    auto snapshot = last.storage->snapshot();
+    Lines frozen = last.model;
+    for (int step = 0; step < 1000; ++step)
+        edit(last, random, random() % last.model.size());
+    verify(last, name + " after snapshot");
+    check(snapshot->lines_count() == frozen.size(),
+        name + " snapshot line count changed");
+    for (size_t i = 0; i < frozen.size() and i < snapshot->lines_count(); ++i)
+        check(snapshot->line(i) == frozen[i],
+            name + " snapshot line " + std::to_string(i) + " changed");
+}
+
+// Server koduje snapshot pre klienta na vlakne spojenia, zatial co
+//  dokument sa dalej upravuje na strande. Kodovanie zapisuje cache do
+//  uzlov zdielanych s povodnym uloziskom a uprava tie iste uzly kopiruje.
+//  Chybu v synchronizacii najde spolahlivo az -fsanitize=thread.
+void concurrent_encode(
+    Storage_type type, const std::string& path, const Lines& initial)
+{
+    std::string name = Document::storage_type_name(type);
+    std::mt19937 random(54321);
+
+    Replica replica { Document::make_storage(type), initial };
+    replica.storage->load(std::make_shared<Document::Line_index>(
+        std::make_shared<Document::Mapped_file>(path)));
+
+    for (int round = 0; round < 20 and failures == 0; ++round) {
+        auto snapshot = replica.storage->snapshot();
+        std::string expected = encoded(replica.model);
+
+        bool same = true;
+        std::thread encoder([&snapshot, &expected, &same]() {
+            for (int i = 0; i < 3; ++i) {
+                Document::Protocol::Chunked_message message;
+                snapshot->encode_lines(message);
+                std::string bytes;
+                for (auto&& chunk : message.chunks())
+                    bytes += *chunk;
+                same = same and bytes == expected;
+            }
+        });
+        for (int step = 0; step < 200; ++step)
+            edit(replica, random, random() % replica.model.size());
+        encoder.join();
+
+        check(same,
+            name + " round " + std::to_string(round)
+                + ": snapshot encoded during edits differs");
+        verify(replica, name + " edited during encoding");
+    }
+}
+
+// Dva subezne zapisy toho isteho suboru maju kazdy vlastny docasny subor,
+//  oba sa podaria a nic po nich neostane
+void concurrent_save(const std::string& directory)
+{
+    namespace fs = std::filesystem;
+    std::string path = directory + "/saved";
+    std::vector<Lines> contents { Lines(100, "first"), Lines(200, "second") };
+
+    std::vector<std::thread> savers;
+    std::vector<int> errors(contents.size(), 0);
+    for (size_t i = 0; i < contents.size(); ++i)
+        savers.emplace_back([&path, &contents, &errors, i]() {
+            auto storage = Document::make_storage(Storage_type::Vector);
+            storage->replace_lines(0, 1, contents[i]);
+            for (int round = 0; round < 50; ++round) {
+                try {
+                    storage->save(path);
+                } catch (std::exception&) {
+                    ++errors[i];
+                }
+            }
+        });
+    for (auto&& saver : savers)
+        saver.join();
+
+    for (size_t i = 0; i < contents.size(); ++i)
+        check(errors[i] == 0,
+            "concurrent save " + std::to_string(i) + " failed "
+                + std::to_string(errors[i]) + " times");
+    Replica saved { Document::make_storage(Storage_type::Vector), {} };
+    saved.storage->load(std::make_shared<Document::Line_index>(
+        std::make_shared<Document::Mapped_file>(path)));
+    saved.model = saved.storage->lines_count() == contents[0].size()
+        ? contents[0]
+        : contents[1];
+    verify(saved, "concurrently saved file");
+    for (auto&& entry : fs::directory_iterator(directory))
+        check(!Document::is_temporary_file_name(
+                  entry.path().filename().string()),
+            "temporary file left: " + entry.path().string());
+}
+
+}
+
+int main()
+{
+    namespace fs = std::filesystem;
+    std::string directory
+        = (fs::temp_directory_path()
+              / ("storage_test." + std::to_string(getpid())))
+              .string();
+    fs::create_directories(directory);
+    std::string path = directory + "/initial";
+
+    // niekolko kusov rope a prazdne riadky
+    std::mt19937 random(1);
+    Lines initial(3000);
+    for (auto&& line : initial)
+        line = random_text(random, 40);
+    {
+        std::ofstream file(path, std::ios::binary);
+        for (size_t i = 0; i < initial.size(); ++i)
+            file << (i != 0 ? "\n" : "") << initial[i];
+    }
+
+    for (auto type : { Storage_type::Vector, Storage_type::Rope,
+             Storage_type::Arena }) {
+        fuzz(type, path, initial);
+        concurrent_encode(type, path, initial);
+    }
+    concurrent_save(directory);
+    fs::remove_all(directory);
+
+    if (failures != 0) {
+        std::cerr << failures << " checks failed" << std::endl;
+        return 1;
+    }
+    std::cout << "storage_test: ok" << std::endl;
+    return 0;
+}
@@ -0,0 +1,245 @@
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <future>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+#include "document.h"
+#include "wal.h"
+
+// Obnova dokumentu z logu po pade servera v roznych chvilach: uprostred
+//  zapisu zaznamu, pred potvrdenim snapshotu a medzi dvoma premenovaniami
+//  pri jeho potvrdeni. Obnova ide rovnako ako Hosted_document::load.
+
+namespace {
+
+namespace fs = std::filesystem;
+
+using Document::Delta;
+using Document::Document_handler;
+using Document::Operation;
+using Document::Wal;
+
+int failures = 0;
+
+void check(bool ok, const std::string& what)
+{
+    if (ok)
+        return;
+    std::cerr << "FAIL: " << what << std::endl;
+    ++failures;
+}
+
+std::vector<std::string> lines(const Document_handler& handler)
+{
+    std::vector<std::string> out;
+    handler.snapshot()->for_each_line(
+        [&out](const Document::Line_view& line) { out.push_back(line.str()); });
+    return out;
+}
+
+// Delty s nahodnymi upravami textu, aplikuju sa aj na model
+class Editor {
+public:
+    Editor()
+        : random(7)
+        , version(0)
+    {
+    }
+
+    Delta next()
+    {
+        Delta delta;
+        delta.version = ++version;
+        size_t count = lines(model).size();
+        for (int i = 0; i < 3; ++i) {
+            size_t line = random() % count;
+            switch (random() % 3) {
+            case 0:
+                delta.operations.push_back(Operation::insert_line(
+                    line, "line " + std::to_string(random() % 1000)));
+                ++count;
+                break;
+            case 1:
+                delta.operations.push_back(
+                    Operation::insert_char(line, 0, 'a' + random() % 26));
+                break;
+            case 2:
+                if (count > 1) {
+                    delta.operations.push_back(Operation::delete_line(line));
+                    --count;
+                }
+                break;
+            }
+        }
+        model.replay(delta);
+        model.set_version(version);
+        return delta;
+    }
+
+    Document_handler model;
+
+private:
+    std::mt19937 random;
+    uint64_t version;
+};
+
+template <typename F> bool wait(F start)
+{
+    std::promise<bool> done;
+    start([&done](bool ok) { done.set_value(ok); });
+    return done.get_future().get();
+}
+
+struct Recovered {
+    uint64_t version;
+    std::vector<std::string> lines;
+};
+
+Recovered recover(const std::string& path)
+{
+    Document_handler handler;
+    Wal::finish_snapshot(path);
+    if (fs::exists(path))
+        handler.open(path);
+    Document::Wal_replay replay = Wal::replay(
+        path, [&handler](const Delta& delta) { handler.replay(delta); });
+    return Recovered { replay.version, lines(handler) };
+}
+
+void expect(const std::string& path, const Editor& editor, uint64_t version,
+    const std::string& what)
+{
+    Recovered recovered = recover(path);
+    check(recovered.version == version,
+        what + ": version " + std::to_string(recovered.version)
+            + ", expected " + std::to_string(version));
+    check(recovered.lines == lines(editor.model), what + ": text differs");
+    check(!fs::exists(path + ".snapshot"), what + ": snapshot left over");
+    check(!fs::exists(path + ".wal.next"), what + ": .wal.next left over");
+}
+
+void remove_files(const std::string& path)
+{
+    for (auto suffix : { "", ".wal", ".wal.next", ".snapshot" })
+        fs::remove(path + suffix);
+}
+
+// Pad uprostred zapisu: z posledneho zaznamu je iba kus alebo ma zle crc
+void torn_tail(const std::string& path, bool corrupt)
+{
+    std::string what = corrupt ? "corrupt tail" : "torn tail";
+    remove_files(path);
+    Wal wal(Document::Durability::Strict, std::chrono::milliseconds(0));
+    wal.start();
+
+    Editor editor;
+    auto log = wal.open(path, 0);
+    for (int i = 0; i < 9; ++i)
+        wal.append(log, editor.next());
+    wal.close(log);
+    uint64_t size = fs::file_size(path + ".wal");
+
+    // desiata delta sa zapise iba ciastocne, obnova skonci na deviatej
+    log = wal.open(path, 0);
+    wal.append(log, editor.next());
+    wal.close(log);
+    if (corrupt) {
+        std::fstream file(path + ".wal",
+            std::ios::in | std::ios::out | std::ios::binary);
+        file.seekg(-1, std::ios::end);
+        char last = file.get();
+        file.seekp(-1, std::ios::end);
+        file.put(last ^ 1);
+    } else
+        fs::resize_file(path + ".wal", fs::file_size(path + ".wal") - 3);
+
+    Recovered recovered = recover(path);
+    check(recovered.version == 9, what + ": replayed up to version 9");
+    check(fs::file_size(path + ".wal") == size,
+        what + ": log truncated after the last whole record");
+
+    // po orezani sa da pokracovat, novy zaznam nesmie ostat za smetim
+    Editor again;
+    for (int i = 0; i < 9; ++i)
+        again.next();
+    log = wal.open(path, recovered.version);
+    Delta delta = again.next();
+    wal.append(log, delta);
+    wal.close(log);
+    wal.stop();
+    expect(path, again, 10, what + " and append");
+}
+
+enum class Crash { Before_commit, Between_renames, After_commit };
+
+// Pad pocas snapshotu vo verzii 5, delty 6 az 8 su uz v .wal.next
+void snapshot_crash(const std::string& path, Crash crash)
+{
+    std::string what = crash == Crash::Before_commit ? "before commit"
+        : crash == Crash::Between_renames            ? "between renames"
+                                                     : "after commit";
+    remove_files(path);
+    Wal wal(Document::Durability::Strict, std::chrono::milliseconds(0));
+    wal.start();
+
+    Editor editor;
+    auto log = wal.open(path, 0);
+    for (int i = 0; i < 5; ++i)
+        wal.append(log, editor.next());
+    bool rotated = wait([&](std::function<void(bool)> done) {
+        wal.rotate(log, 5, done);
+    });
+    check(rotated, what + ": rotate");
+    auto snapshot = editor.model.snapshot();
+    for (int i = 0; i < 3; ++i)
+        wal.append(log, editor.next());
+    snapshot->save(path + ".snapshot");
+
+    if (crash == Crash::After_commit) {
+        bool committed = wait([&](std::function<void(bool)> done) {
+            wal.commit(log, done);
+        });
+        check(committed, what + ": commit");
+        wal.append(log, editor.next());
+    }
+    wal.close(log);
+    wal.stop();
+    // commit najprv premenuje .wal.next na .wal a az potom snapshot
+    if (crash == Crash::Between_renames)
+        fs::rename(path + ".wal.next", path + ".wal");
+
+    expect(path, editor, crash == Crash::After_commit ? 9 : 8, what);
+    if (crash != Crash::Before_commit)
+        check(fs::exists(path), what + ": snapshot became the document");
+}
+
+}
+
+int main()
+{
+    std::string dir = (fs::temp_directory_path()
+        / ("wal_test." + std::to_string(getpid())))
+                          .string();
+    fs::create_directories(dir);
+    std::string path = dir + "/doc";
+
+    torn_tail(path, false);
+    torn_tail(path, true);
+    snapshot_crash(path, Crash::Before_commit);
+    snapshot_crash(path, Crash::Between_renames);
+    snapshot_crash(path, Crash::After_commit);
+    fs::remove_all(dir);
+
+    if (failures != 0) {
+        std::cerr << failures << " checks failed" << std::endl;
+        return 1;
+    }
+    std::cout << "wal_test: ok" << std::endl;
+    return 0;
+}
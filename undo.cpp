@@ -0,0 +1,196 @@
+#include <algorithm>
+#include <string>
+#include <string_view>
+
+#include "undo.h"
+
+namespace Document {
+
+namespace {
+    // Pozicia za textom vlozenym na at
+    Position end_of(Position at, std::string_view text)
+    {
+        for (char ch : text)
+            if (ch == '\n')
+                at = { at.first + 1, 0 };
+            else
+                ++at.second;
+        return at;
+    }
+}
+
+Undo_history::Undo_history(Document& document)
+    : document(document)
+    , memory_(0)
+    , mergeable(false)
+{
+    document.marks.push_back(&positions);
+}
+
+Undo_history::~Undo_history()
+{
+    end_edit();
+    auto& marks = document.marks;
+    marks.erase(std::find(marks.begin(), marks.end(), &positions));
+}
+
+void Undo_history::begin_edit() { document.fixed = &positions; }
+
+void Undo_history::end_edit()
+{
+    if (document.fixed == &positions)
+        document.fixed = nullptr;
+}
+
+void Undo_history::record(const Edit& edit, Position cursor, uint64_t sequence)
+{
+    clear(redo_steps);
+
+    // jeden znak okrem konca riadku sa prida k poslednemu kroku zo znakov
+    bool single = edit.removed.size() + edit.inserted.size() == 1
+        and edit.removed != "\n" and edit.inserted != "\n";
+    if (mergeable and single and !undo_steps.empty()) {
+        Step& step = undo_steps.back();
+        Position at(step.line, step.column);
+        if (edit.removed.empty()) {
+            if (edit.start == end_of(at, step.after)) {
+                step.after += edit.inserted;
+                ++memory_;
+                return;
+            }
+        } else if (!step.after.empty()) {
+            // backspace v prave napisanom texte
+            std::string_view typed(step.after.data(), step.after.size() - 1);
+            if (edit.removed.back() == step.after.back()
+                and edit.start == end_of(at, typed)) {
+                step.after.pop_back();
+                --memory_;
+                if (step.after.empty() and step.before.empty()) {
+                    pop_back(undo_steps);
+                    mergeable = false;
+                }
+                return;
+            }
+        } else if (cursor == at) {
+            // delete na mieste kroku alebo backspace tesne pred nim
+            if (edit.start == at) {
+                step.before += edit.removed;
+                ++memory_;
+                return;
+            }
+            if (Position(edit.start.first, edit.start.second + 1) == at) {
+                step.before.insert(0, edit.removed);
+                ++memory_;
+                positions.erase(step.entry);
+                --step.column;
+                step.entry = positions.insert(&step);
+                return;
+            }
+        }
+    }
+    push(undo_steps, edit.start, edit.removed, edit.inserted, sequence);
+    mergeable = single;
+}
+
+void Undo_history::separate() { mergeable = false; }
+
+bool Undo_history::undo(Cursor& cursor)
+{
+    return apply(undo_steps, redo_steps, cursor, true);
+}
+
+bool Undo_history::redo(Cursor& cursor)
+{
+    return apply(redo_steps, undo_steps, cursor, false);
+}
+
+bool Undo_history::apply(std::deque<Step>& from, std::deque<Step>& to,
+    Cursor& cursor, bool undo)
+{
+    mergeable = false;
+    while (!from.empty()) {
+        Step& step = from.back();
+        Position at(step.line, step.column);
+        std::string present, restored;
+        present.swap(undo ? step.after : step.before);
+        restored.swap(undo ? step.before : step.after);
+        uint64_t sequence = step.sequence;
+        memory_ -= present.size() + restored.size();
+        pop_back(from);
+
+        // text kroku zmenil iny cursor, krok uz nejde vratit
+        Position end = end_of(at, present);
+        if (document.text(at, end) != present)
+            continue;
+
+        Position new_end = document.replace_range(at, end, restored);
+        cursor.set(new_end.first, new_end.second);
+        cursor.collapse();
+        if (undo)
+            push(to, at, std::move(restored), std::move(present), sequence);
+        else
+            push(to, at, std::move(present), std::move(restored), sequence);
+        return true;
+    }
+    return false;
+}
+
+size_t Undo_history::memory() const { return memory_; }
+
+bool Undo_history::empty() const
+{
+    return undo_steps.empty() and redo_steps.empty();
+}
+
+uint64_t Undo_history::oldest() const
+{
+    if (!undo_steps.empty())
+        return undo_steps.front().sequence;
+    return redo_steps.empty() ? UINT64_MAX : redo_steps.front().sequence;
+}
+
+void Undo_history::drop_oldest()
+{
+    // najprv najstarsie undo, potom redo najdalej od aktualneho stavu
+    if (!undo_steps.empty())
+        pop_front(undo_steps);
+    else if (!redo_steps.empty())
+        pop_front(redo_steps);
+}
+
+void Undo_history::push(std::deque<Step>& steps, Position at,
+    std::string before, std::string after, uint64_t sequence)
+{
+    memory_ += sizeof(Step) + before.size() + after.size();
+    Step& step = steps.emplace_back();
+    step.line = at.first;
+    step.column = at.second;
+    step.before = std::move(before);
+    step.after = std::move(after);
+    step.sequence = sequence;
+    step.entry = positions.insert(&step);
+}
+
+void Undo_history::pop_back(std::deque<Step>& steps)
+{
+    Step& step = steps.back();
+    memory_ -= sizeof(Step) + step.before.size() + step.after.size();
+    positions.erase(step.entry);
+    steps.pop_back();
+}
+
+void Undo_history::pop_front(std::deque<Step>& steps)
+{
+    Step& step = steps.front();
+    memory_ -= sizeof(Step) + step.before.size() + step.after.size();
+    positions.erase(step.entry);
+    steps.pop_front();
+}
+
+void Undo_history::clear(std::deque<Step>& steps)
+{
+    while (!steps.empty())
+        pop_back(steps);
+}
+
+}
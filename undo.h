@@ -0,0 +1,76 @@
+#ifndef M_UNDO
+#define M_UNDO
+
+#include <cstdint>
+#include <deque>
+#include <string>
+
+#include "document.h"
+
+namespace Document {
+
+// Undo a redo jedneho cursora. Krok je iba inverzna uprava: na mieste
+//  kroku je teraz text after, undo ho nahradi textom before. Miesto je
+//  Mark, ktory posuvaju iba upravy ostatnych cursorov. Vlastne upravy
+//  kroky vracaju v opacnom poradi, takze pozicie starsich krokov su po
+//  undo znova presne. Ak text kroku zmenil iny cursor, krok sa zahodi.
+//
+// Pisanie a mazanie po jednom znaku sa spaja do jedneho kroku, skupinu
+//  ukonci pohyb cursora (separate) alebo novy riadok.
+class Undo_history {
+public:
+    explicit Undo_history(Document& document);
+    ~Undo_history();
+
+    // Kroky su marky dokumentu
+    Undo_history(const Undo_history&) = delete;
+    Undo_history& operator=(const Undo_history&) = delete;
+
+    // Upravy dokumentu medzi begin_edit a end_edit robi tento cursor
+    void begin_edit();
+    void end_edit();
+
+    // Uprava tohto cursora, cursor je hlava pred nou. Zmaze redo.
+    void record(const Edit& edit, Position cursor, uint64_t sequence);
+    // Dalsia uprava sa uz nespoji s poslednym krokom
+    void separate();
+
+    // Jednou upravou dokumentu vrati posledny krok a cursor da za vrateny
+    //  text. Vrati false, ak nie je co vratit.
+    bool undo(Cursor& cursor);
+    bool redo(Cursor& cursor);
+
+    // Bajty krokov v oboch zasobnikoch
+    size_t memory() const;
+    bool empty() const;
+    // Poradie najstarsieho kroku, ten zahodi drop_oldest
+    uint64_t oldest() const;
+    void drop_oldest();
+
+private:
+    struct Step : Mark {
+        std::string before, after;
+        uint64_t sequence;
+    };
+
+    // Krok z from sa znova vykona a presunie do to
+    bool apply(std::deque<Step>& from, std::deque<Step>& to, Cursor& cursor,
+        bool undo);
+    void push(std::deque<Step>& steps, Position at, std::string before,
+        std::string after, uint64_t sequence);
+    void pop_back(std::deque<Step>& steps);
+    void pop_front(std::deque<Step>& steps);
+    void clear(std::deque<Step>& steps);
+
+    Document& document;
+    std::deque<Step> undo_steps, redo_steps;
+    // Pozicie krokov, v Document::marks
+    Mark_set positions;
+    size_t memory_;
+    // Posledny krok je skupina znakov, dalsi znak sa k nemu moze pridat
+    bool mergeable;
+};
+
+}
+
+#endif
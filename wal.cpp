@@ -0,0 +1,611 @@
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <fcntl.h>
+#include <filesystem>
+#include <future>
+#include <system_error>
+#include <unistd.h>
+
+#include "file.h"
+#include "log.h"
+#include "wal.h"
+
+namespace Document {
+
+namespace fs = std::filesystem;
+
+class Wal_log {
+public:
+    explicit Wal_log(std::string path)
+        : path(std::move(path))
+        , fd(-1)
+        , rotated(false)
+        , queued(false)
+        , unsynced(false)
+        , failed(false)
+    {
+    }
+
+    ~Wal_log()
+    {
+        if (fd >= 0)
+            ::close(fd);
+    }
+
+    Wal_log(const Wal_log&) = delete;
+    Wal_log& operator=(const Wal_log&) = delete;
+
+    const std::string path;
+    // .wal, po rotacii .wal.next
+    int fd;
+    // Zaradene zaznamy, ktore este neboli zapisane
+    std::string buffer;
+    bool rotated;
+    // buffer je v zozname na zapis na konci davky
+    bool queued;
+    // Zapisane, este bez fsync-u
+    bool unsynced;
+    // Po chybe zapisu sa dalsie zaznamy zahadzuju
+    bool failed;
+};
+
+namespace {
+    // Hlavicka suboru: MAGIC a base (8 bajtov little endian). Zaznam:
+    //  dlzka a crc32 payloadu (po 4 bajty) a payload, zakodovana Delta.
+    const std::string_view MAGIC("DOCWAL1\n");
+    const size_t FILE_HEADER_SIZE = 16;
+    const size_t RECORD_HEADER_SIZE = 8;
+
+    std::system_error errno_error(const std::string& what)
+    {
+        return std::system_error(errno, std::generic_category(), what);
+    }
+
+    uint32_t crc32(std::string_view data)
+    {
+        static const std::array<uint32_t, 256> table = []() {
+            std::array<uint32_t, 256> table;
+            for (uint32_t i = 0; i < 256; ++i) {
+                uint32_t crc = i;
+                for (int bit = 0; bit < 8; ++bit)
+                    crc = (crc & 1) ? (crc >> 1) ^ 0xedb88320 : crc >> 1;
+                table[i] = crc;
+            }
+            return table;
+        }();
+        uint32_t crc = 0xffffffff;
+        for (unsigned char ch : data)
+            crc = table[(crc ^ ch) & 0xff] ^ (crc >> 8);
+        return crc ^ 0xffffffff;
+    }
+
+    void put_fixed(std::string& out, uint64_t value, size_t size)
+    {
+        for (size_t i = 0; i < size; ++i)
+            out += char(value >> (8 * i));
+    }
+
+    uint64_t get_fixed(const char* data, size_t size)
+    {
+        uint64_t value = 0;
+        for (size_t i = 0; i < size; ++i)
+            value |= uint64_t(uint8_t(data[i])) << (8 * i);
+        return value;
+    }
+
+    void write_all(int fd, std::string_view data, const std::string& path)
+    {
+        while (!data.empty()) {
+            ssize_t written = ::write(fd, data.data(), data.size());
+            if (written < 0 and errno != EINTR)
+                throw errno_error("write " + path);
+            if (written > 0)
+                data.remove_prefix(written);
+        }
+    }
+
+    int open_append(const std::string& path)
+    {
+        int fd = ::open(path.c_str(), O_WRONLY | O_APPEND);
+        if (fd < 0)
+            throw errno_error("open " + path);
+        return fd;
+    }
+
+    // Novy prazdny log, trvaly uz pred prvym zaznamom
+    int create_log(const std::string& path, uint64_t base)
+    {
+        int fd = ::open(
+            path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+        if (fd < 0)
+            throw errno_error("open " + path);
+        std::string header(MAGIC);
+        put_fixed(header, base, 8);
+        try {
+            write_all(fd, header, path);
+            if (fdatasync(fd) < 0)
+                throw errno_error("fsync " + path);
+        } catch (...) {
+            ::close(fd);
+            throw;
+        }
+        sync_directory(path);
+        return fd;
+    }
+
+    struct Log_contents {
+        bool valid;
+        uint64_t base;
+        // Koniec posledneho celeho zaznamu
+        size_t end;
+    };
+
+    // Prejde cele zaznamy so spravnym crc, f dostane deltu aj surovy
+    //  zaznam. Za prvym poskodenym uz nic platne nie je.
+    Log_contents scan(const Mapped_file& file,
+        const std::function<void(const Delta&, std::string_view)>& f)
+    {
+        const char* data = file.data();
+        size_t size = file.size();
+        if (size < FILE_HEADER_SIZE
+            or std::string_view(data, MAGIC.size()) != MAGIC)
+            return Log_contents { false, 0, 0 };
+
+        Log_contents contents { true,
+            get_fixed(data + MAGIC.size(), 8), FILE_HEADER_SIZE };
+        while (size - contents.end >= RECORD_HEADER_SIZE) {
+            const char* record = data + contents.end;
+            size_t length = get_fixed(record, 4);
+            if (size - contents.end - RECORD_HEADER_SIZE < length)
+                break;
+            std::string_view payload(record + RECORD_HEADER_SIZE, length);
+            if (crc32(payload) != get_fixed(record + 4, 4))
+                break;
+            try {
+                f(Delta(payload.data(), payload.data() + payload.size()),
+                    std::string_view(record, RECORD_HEADER_SIZE + length));
+            } catch (Protocol::Protocol_error&) {
+                break;
+            }
+            contents.end += RECORD_HEADER_SIZE + length;
+        }
+        return contents;
+    }
+
+    // Pripise platne zaznamy z .wal.next do .wal a .wal.next zmaze.
+    //  Zaznam, ktory uz v .wal je, replay preskoci podla verzie.
+    void merge_next(const std::string& path)
+    {
+        std::string log_path = path + ".wal", next_path = path + ".wal.next";
+        std::string records;
+        Log_contents contents;
+        {
+            Mapped_file next(next_path);
+            contents = scan(next, [&records](const Delta&,
+                                      std::string_view record) {
+                records.append(record);
+            });
+        }
+        if (contents.valid) {
+            int fd = fs::exists(log_path) ? open_append(log_path)
+                                          : create_log(log_path, contents.base);
+            try {
+                write_all(fd, records, log_path);
+                if (fdatasync(fd) < 0)
+                    throw errno_error("fsync " + log_path);
+            } catch (...) {
+                ::close(fd);
+                throw;
+            }
+            ::close(fd);
+        }
+        fs::remove(next_path);
+        sync_directory(path);
+    }
+
+    // Snapshot bez .wal.next uz bol potvrdeny, iba sa nestihol premenovat
+    void complete_snapshot(const std::string& path)
+    {
+        if (!fs::exists(path + ".snapshot"))
+            return;
+        if (fs::exists(path + ".wal.next"))
+            fs::remove(path + ".snapshot");
+        else
+            fs::rename(path + ".snapshot", path);
+        sync_directory(path);
+    }
+
+    bool ends_with(std::string_view name, std::string_view suffix)
+    {
+        return name.size() >= suffix.size()
+            and name.substr(name.size() - suffix.size()) == suffix;
+    }
+}
+
+bool parse_durability(const std::string& name, Durability& durability)
+{
+    for (int i = int(Durability::None); i <= int(Durability::Strict); ++i)
+        if (name == durability_name(Durability(i))) {
+            durability = Durability(i);
+            return true;
+        }
+    return false;
+}
+
+const char* durability_name(Durability durability)
+{
+    switch (durability) {
+    case Durability::None:
+        return "none";
+    case Durability::Async:
+        return "async";
+    case Durability::Batch:
+        return "batch";
+    case Durability::Strict:
+        return "strict";
+    }
+    return "unknown";
+}
+
+bool is_wal_file_name(std::string_view name)
+{
+    for (std::string_view suffix : { ".wal", ".wal.next", ".snapshot", ".tmp" })
+        if (ends_with(name, suffix))
+            return true;
+    return is_temporary_file_name(name);
+}
+
+Wal::Wal(Durability durability, std::chrono::milliseconds interval)
+    : durability_(durability)
+    , interval(interval)
+    , running(false)
+    , records(0)
+    , bytes(0)
+    , syncs(0)
+{
+}
+
+Wal::~Wal() { stop(); }
+
+void Wal::start()
+{
+    std::lock_guard<std::mutex> lock(mtx);
+    if (running)
+        return;
+    running = true;
+    writer = std::thread(&Wal::run, this);
+}
+
+void Wal::stop()
+{
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        if (!running)
+            return;
+        running = false;
+    }
+    wake.notify_one();
+    writer.join();
+}
+
+Durability Wal::durability() const { return durability_; }
+
+Wal_stats Wal::stats() const { return Wal_stats { records, bytes, syncs }; }
+
+void Wal::finish_snapshot(const std::string& path)
+{
+    // nedopisany .snapshot.tmp.* zmaze remove_temporary_files pri starte
+    complete_snapshot(path);
+}
+
+Wal_replay Wal::replay(
+    const std::string& path, const std::function<void(const Delta&)>& f)
+{
+    std::string log_path = path + ".wal", next_path = path + ".wal.next";
+    Wal_replay result { 0, 0, 0 };
+    uint64_t& version = result.version;
+    auto apply = [&result, &f](const Delta& delta, std::string_view record) {
+        if (delta.version > result.version) {
+            f(delta);
+            result.version = delta.version;
+            ++result.deltas;
+            result.bytes += record.size();
+        }
+    };
+
+    if (fs::exists(log_path)) {
+        Log_contents contents;
+        size_t size;
+        {
+            Mapped_file file(log_path);
+            size = file.size();
+            if (size >= FILE_HEADER_SIZE)
+                version = get_fixed(file.data() + MAGIC.size(), 8);
+            contents = scan(file, apply);
+        }
+        // log bez celej hlavicky nema ziadne zaznamy, zalozi sa znova
+        if (!contents.valid) {
+            version = 0;
+            fs::remove(log_path);
+        } else if (contents.end < size) {
+            LOG(Warning,
+                "Truncating " + log_path + ": "
+                    + std::to_string(size - contents.end) + " bytes");
+            fs::resize_file(log_path, contents.end);
+        }
+    }
+    if (fs::exists(next_path)) {
+        {
+            Mapped_file next(next_path);
+            scan(next, apply);
+        }
+        merge_next(path);
+    }
+    return result;
+}
+
+bool Wal::has_tail(const std::string& path)
+{
+    std::error_code error;
+    auto size = fs::file_size(path + ".wal", error);
+    return (!error and size > FILE_HEADER_SIZE)
+        or fs::exists(path + ".wal.next", error);
+}
+
+std::shared_ptr<Wal_log> Wal::open(const std::string& path, uint64_t base)
+{
+    auto log = std::make_shared<Wal_log>(path);
+    std::string log_path = path + ".wal";
+    log->fd = fs::exists(log_path) ? open_append(log_path)
+                                   : create_log(log_path, base);
+    return log;
+}
+
+size_t Wal::append(const std::shared_ptr<Wal_log>& log, const Delta& delta,
+    std::function<void()> done)
+{
+    // cursory sa po restarte nevracaju, logovat staci text
+    Delta logged;
+    logged.version = delta.version;
+    for (auto&& operation : delta.operations)
+        if (operation.edits_text())
+            logged.operations.push_back(operation);
+
+    std::string record;
+    if (!logged.operations.empty()) {
+        std::string payload;
+        logged.encode(payload);
+        put_fixed(record, payload.size(), 4);
+        put_fixed(record, crc32(payload), 4);
+        record += payload;
+    }
+    if (record.empty() and !done)
+        return 0;
+
+    size_t size = record.size();
+    std::function<void(bool)> callback;
+    if (done)
+        callback = [done = std::move(done)](bool) { done(); };
+    push(Request { Request::Kind::Append, log, std::move(record),
+        delta.version, std::move(callback) });
+    return size;
+}
+
+void Wal::rotate(const std::shared_ptr<Wal_log>& log, uint64_t version,
+    std::function<void(bool)> done)
+{
+    push(Request { Request::Kind::Rotate, log, {}, version, std::move(done) });
+}
+
+void Wal::commit(
+    const std::shared_ptr<Wal_log>& log, std::function<void(bool)> done)
+{
+    push(Request { Request::Kind::Commit, log, {}, 0, std::move(done) });
+}
+
+void Wal::close(const std::shared_ptr<Wal_log>& log)
+{
+    std::promise<void> closed;
+    std::future<void> future = closed.get_future();
+    push(Request { Request::Kind::Close, log, {}, 0,
+        [&closed](bool) { closed.set_value(); } });
+    future.wait();
+}
+
+void Wal::push(Request request)
+{
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        if (running) {
+            requests.push_back(std::move(request));
+            wake.notify_one();
+            return;
+        }
+    }
+    // bez vlakna (pred start, po stop) sa poziadavka vybavi hned
+    std::vector<Request> batch;
+    batch.push_back(std::move(request));
+    process(batch);
+    sync_all();
+}
+
+void Wal::run()
+{
+    std::vector<Request> batch;
+    std::unique_lock<std::mutex> lock(mtx);
+    for (;;) {
+        if (requests.empty()) {
+            if (!running)
+                break;
+            // cakajuci fsync v rezime Batch ma svoj termin
+            if (durability_ == Durability::Batch and !unsynced.empty())
+                wake.wait_until(lock, next_sync);
+            else
+                wake.wait(lock);
+        }
+        // vsetko, co sa nazbieralo pocas predoslej davky, je dalsia davka
+        batch.swap(requests);
+        lock.unlock();
+        process(batch);
+        batch.clear();
+        lock.lock();
+    }
+    lock.unlock();
+    sync_all();
+}
+
+void Wal::process(std::vector<Request>& batch)
+{
+    std::vector<std::shared_ptr<Wal_log>> written;
+    std::vector<std::function<void(bool)>> appended;
+
+    for (auto&& request : batch) {
+        Wal_log& log = *request.log;
+        switch (request.kind) {
+        case Request::Kind::Append:
+            if (!request.data.empty() and !log.failed) {
+                log.buffer += request.data;
+                ++records;
+                bytes += request.data.size();
+                if (!log.queued) {
+                    log.queued = true;
+                    written.push_back(request.log);
+                }
+            }
+            if (request.done)
+                appended.push_back(std::move(request.done));
+            break;
+        case Request::Kind::Rotate: {
+            bool ok = false;
+            try {
+                write(request.log);
+                sync(request.log);
+                ::close(log.fd);
+                log.fd = -1;
+                if (log.rotated) {
+                    // predosly snapshot sa nepotvrdil, jeho delty ostanu
+                    //  v .wal
+                    fs::remove(log.path + ".snapshot");
+                    merge_next(log.path);
+                }
+                complete_snapshot(log.path);
+                log.fd = create_log(log.path + ".wal.next", request.version);
+                log.rotated = true;
+                ok = true;
+            } catch (std::exception& e) {
+                LOG(Error, "Cannot rotate " + log.path + ".wal: " + e.what());
+                if (log.fd < 0) {
+                    try {
+                        log.fd = open_append(log.path + ".wal");
+                    } catch (std::exception&) {
+                        log.failed = true;
+                    }
+                }
+            }
+            request.done(ok);
+            break;
+        }
+        case Request::Kind::Commit: {
+            bool ok = false;
+            try {
+                write(request.log);
+                sync(request.log);
+                if (!log.rotated)
+                    throw std::runtime_error("log not rotated");
+                fs::rename(log.path + ".wal.next", log.path + ".wal");
+                sync_directory(log.path);
+                log.rotated = false;
+                fs::rename(log.path + ".snapshot", log.path);
+                sync_directory(log.path);
+                ok = true;
+            } catch (std::exception& e) {
+                LOG(Error, "Cannot commit snapshot " + log.path + ": "
+                        + e.what());
+            }
+            request.done(ok);
+            break;
+        }
+        case Request::Kind::Close:
+            try {
+                write(request.log);
+                sync(request.log);
+            } catch (std::exception& e) {
+                LOG(Error, "Cannot close " + log.path + ".wal: " + e.what());
+            }
+            if (log.fd >= 0)
+                ::close(log.fd);
+            log.fd = -1;
+            request.done(true);
+            break;
+        }
+    }
+
+    // jeden write na log za davku
+    for (auto&& log : written) {
+        log->queued = false;
+        try {
+            write(log);
+        } catch (std::exception& e) {
+            LOG(Error, "Cannot write " + log->path + ".wal: " + e.what());
+        }
+    }
+    if (durability_ == Durability::Strict
+        or (durability_ == Durability::Batch and !unsynced.empty()
+            and std::chrono::steady_clock::now() >= next_sync))
+        sync_all();
+
+    for (auto&& done : appended)
+        done(true);
+}
+
+void Wal::write(const std::shared_ptr<Wal_log>& log)
+{
+    if (log->buffer.empty())
+        return;
+    std::string buffer;
+    buffer.swap(log->buffer);
+    try {
+        if (log->fd < 0)
+            throw std::runtime_error("log is closed");
+        write_all(log->fd, buffer, log->path);
+    } catch (...) {
+        log->failed = true;
+        throw;
+    }
+    if (!log->unsynced) {
+        log->unsynced = true;
+        if (unsynced.empty())
+            next_sync = std::chrono::steady_clock::now() + interval;
+        unsynced.push_back(log);
+    }
+}
+
+void Wal::sync(const std::shared_ptr<Wal_log>& log)
+{
+    if (!log->unsynced)
+        return;
+    log->unsynced = false;
+    unsynced.erase(std::remove(unsynced.begin(), unsynced.end(), log),
+        unsynced.end());
+    if (log->fd >= 0) {
+        if (fdatasync(log->fd) < 0)
+            throw errno_error("fsync " + log->path);
+        ++syncs;
+    }
+}
+
+void Wal::sync_all()
+{
+    std::vector<std::shared_ptr<Wal_log>> logs;
+    logs.swap(unsynced);
+    for (auto&& log : logs) {
+        log->unsynced = false;
+        if (log->fd >= 0 and fdatasync(log->fd) < 0)
+            LOG(Error, "Cannot fsync " + log->path + ".wal");
+        else if (log->fd >= 0)
+            ++syncs;
+    }
+}
+
+}
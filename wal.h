@@ -0,0 +1,138 @@
+#ifndef M_WAL
+#define M_WAL
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include "protocol.h"
+
+namespace Document {
+
+// Kolko z toho, co uz klienti videli, moze prist o data pri pade servera
+enum class Durability : uint8_t {
+    None, // nic sa neloguje, snapshot iba pri vyradeni a ukonceni
+    Async, // kazda delta ide do logu, fsync necha na systeme
+    Batch, // jeden fsync za interval pre vsetky logy naraz
+    Strict, // delta ide klientom az po fsync-u davky, v ktorej bola
+};
+
+bool parse_durability(const std::string& name, Durability& durability);
+const char* durability_name(Durability durability);
+
+// Pripony suborov logu a snapshotov a docasne subory, dokument sa tak
+//  volat nesmie
+bool is_wal_file_name(std::string_view name);
+
+// Log jedneho dokumentu, pracuje s nim iba vlakno Wal
+class Wal_log;
+
+struct Wal_stats {
+    uint64_t records, bytes, syncs;
+};
+
+struct Wal_replay {
+    // Verzia poslednej delty, bez delt base
+    uint64_t version;
+    size_t deltas, bytes;
+};
+
+// Log upravy dokumentov. Subory dokumentu ulozeneho v path:
+//  path            text snapshotu verzie base
+//  path.wal        base a delty s vyssou verziou
+//  path.wal.next   po rotacii dalsie delty, base je verzia noveho snapshotu
+//  path.snapshot   novy snapshot, kym sa nepotvrdi
+// Snapshot sa potvrdi premenovanim .wal.next na .wal a az potom sa
+//  premenuje na path, obnova po pade tak vie dokoncit aj zahodit kazdy
+//  medzistav.
+//
+// Vsetky logy zapisuje jedno vlakno. Zoberie naraz vsetky cakajuce
+//  poziadavky, kazdy log zapise jednym write a fsync urobi raz za davku
+//  (Strict) alebo raz za interval (Batch), nie za kazdu upravu.
+class Wal {
+public:
+    Wal(Durability durability, std::chrono::milliseconds interval);
+    ~Wal();
+
+    Wal(const Wal&) = delete;
+    Wal& operator=(const Wal&) = delete;
+
+    void start();
+    // Zapise a fsync-ne vsetko, co este caka
+    void stop();
+
+    Durability durability() const;
+    Wal_stats stats() const;
+
+    // Obnova na volajucom vlakne. Najprv finish_snapshot, potom sa nacita
+    //  path a replay mu da delty z logu. Poskodeny koniec logu (zapis
+    //  prerusil pad) sa oreze.
+    static void finish_snapshot(const std::string& path);
+    static Wal_replay replay(const std::string& path,
+        const std::function<void(const Delta&)>& f);
+    // V logu su delty, ktore snapshot nema
+    static bool has_tail(const std::string& path);
+
+    // Otvori log na pripisovanie, chybajuci zalozi s base
+    std::shared_ptr<Wal_log> open(const std::string& path, uint64_t base);
+    // Upravy textu z delty zakoduje na volajucom vlakne a zaradi, vrati
+    //  pocet bajtov. done sa zavola z vlakna logu po zapise, pri Strict
+    //  po fsync-u, v poradi poziadaviek.
+    size_t append(const std::shared_ptr<Wal_log>& log, const Delta& delta,
+        std::function<void()> done = {});
+    // Dalsie delty pojdu do .wal.next, snapshot bude mat verziu version.
+    //  Snapshot sa smie zacat zapisovat az v done (z vlakna logu).
+    void rotate(const std::shared_ptr<Wal_log>& log, uint64_t version,
+        std::function<void(bool)> done);
+    // Snapshot je zapisany v path.snapshot, potvrdi ho. done z vlakna logu.
+    void commit(
+        const std::shared_ptr<Wal_log>& log, std::function<void(bool)> done);
+    // Zapise, fsync-ne a zavrie log, pocka na vlakno logu
+    void close(const std::shared_ptr<Wal_log>& log);
+
+private:
+    struct Request {
+        enum class Kind { Append, Rotate, Commit, Close };
+
+        Kind kind;
+        std::shared_ptr<Wal_log> log;
+        std::string data;
+        uint64_t version;
+        std::function<void(bool)> done;
+    };
+
+    void push(Request request);
+    void run();
+    void process(std::vector<Request>& batch);
+    // Iba vlakno logu
+    void write(const std::shared_ptr<Wal_log>& log);
+    void sync(const std::shared_ptr<Wal_log>& log);
+    void sync_all();
+
+    const Durability durability_;
+    const std::chrono::milliseconds interval;
+
+    std::mutex mtx;
+    std::condition_variable wake;
+    std::vector<Request> requests;
+    bool running;
+    std::thread writer;
+
+    // Iba vlakno logu: zapisane, ale este nie fsync-nute logy
+    std::vector<std::shared_ptr<Wal_log>> unsynced;
+    std::chrono::steady_clock::time_point next_sync;
+
+    std::atomic<uint64_t> records, bytes, syncs;
+};
+
+}
+
+#endif